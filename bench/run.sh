@@ -0,0 +1,36 @@
+#!/bin/sh
+# Run wmbench against a fresh wmd on a private Xvfb and print its report.
+# usage: bench/run.sh [windows] [rounds]
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+display=:${BENCH_DISPLAY:-77}
+runtime=$(mktemp -d)
+
+cleanup() {
+    kill "$wmd" "$xvfb" 2>/dev/null || true
+    wait 2>/dev/null || true
+    rm -rf "$runtime"
+}
+trap cleanup EXIT INT TERM
+
+Xvfb "$display" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+export DISPLAY=$display
+export XDG_RUNTIME_DIR=$runtime
+
+for i in $(seq 50); do
+    xdpyinfo >/dev/null 2>&1 && break
+    sleep 0.1
+done
+
+./wmd &
+wmd=$!
+for i in $(seq 50); do
+    ./wmc stats >/dev/null 2>&1 && break
+    sleep 0.1
+done
+
+bench/wmbench "${1:-100}" "${2:-10}"
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+
+#include "wmc.h"
+
+/* Drives the wmd serving $DISPLAY with synthetic clients and reports, one
+ * "name\tvalue" line each, how long its operations take and, from its
+ * stats command, the X requests and replies they cost. Meant to run
+ * against an otherwise empty Xvfb, see run.sh. */
+
+#define FOCUS_TIMEOUT 1000000
+
+/* ICCCM WM_NORMAL_HINTS flags */
+enum {
+    PMinSize = 1 << 4,
+    PResizeInc = 1 << 6,
+    PBaseSize = 1 << 8
+};
+
+static xcb_connection_t *connection;
+static xcb_screen_t *screen;
+static WmcConnection *conn;
+static xcb_atom_t WM_PROTOCOLS;
+static xcb_atom_t WM_DELETE_WINDOW;
+static xcb_atom_t WM_TAKE_FOCUS;
+static xcb_atom_t _NET_WM_NAME;
+static xcb_atom_t _NET_WM_PID;
+static xcb_atom_t UTF8_STRING;
+
+void die(const char *error) {
+    fprintf(stderr, "%s\n", error);
+    exit(EXIT_FAILURE);
+}
+
+long long get_time_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+xcb_atom_t intern_atom(const char *name) {
+    xcb_intern_atom_reply_t *reply;
+    xcb_atom_t atom = XCB_ATOM_NONE;
+
+    if ((reply = xcb_intern_atom_reply(connection,
+                                       xcb_intern_atom(connection, 0, strlen(name), name),
+                                       NULL))) {
+        atom = reply->atom;
+        free(reply);
+    }
+    return atom;
+}
+
+/* wait until the server has processed everything sent so far */
+void sync_connection() {
+    free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL));
+}
+
+int compare_latency(const void *a, const void *b) {
+    long long latency_a = *(const long long *) a;
+    long long latency_b = *(const long long *) b;
+
+    return latency_a < latency_b ? -1 : latency_a > latency_b;
+}
+
+void print_latencies(const char *name, long long *latencies, int n) {
+    long long total = 0;
+
+    if (!n) {
+        return;
+    }
+    qsort(latencies, n, sizeof(*latencies), compare_latency);
+    for (int i = 0; i < n; i++) {
+        total += latencies[i];
+    }
+    printf("%s_us\tmean %lld\tp50 %lld\tp99 %lld\tmax %lld\n", name, total / n,
+           latencies[n / 2], latencies[(n * 99) / 100], latencies[n - 1]);
+}
+
+void set_title(xcb_window_t window, int count) {
+    char title[64];
+    int length = snprintf(title, sizeof(title), "wmbench %u: %d", window, count);
+
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, _NET_WM_NAME,
+                        UTF8_STRING, 8, length, title);
+}
+
+/* a window set up like a terminal: size hints with increments, a class,
+ * a pid and the usual protocols */
+xcb_window_t create_window(int i) {
+    xcb_window_t window = xcb_generate_id(connection);
+    uint32_t mask = XCB_EVENT_MASK_FOCUS_CHANGE|XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    uint32_t hints[18] = { 0 };
+    xcb_atom_t protocols[] = { WM_DELETE_WINDOW, WM_TAKE_FOCUS };
+    uint32_t pid = getpid();
+    char class[] = "wmbench\0Wmbench";
+
+    xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root,
+                      0, 0, 640, 480, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, &mask);
+    hints[0] = PMinSize|PResizeInc|PBaseSize;
+    hints[5] = 40;
+    hints[6] = 30;
+    hints[9] = 7;
+    hints[10] = 14;
+    hints[15] = 4;
+    hints[16] = 4;
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_NORMAL_HINTS,
+                        XCB_ATOM_WM_SIZE_HINTS, 32, 18, hints);
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_CLASS,
+                        XCB_ATOM_STRING, 8, sizeof(class), class);
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, WM_PROTOCOLS,
+                        XCB_ATOM_ATOM, 32, 2, protocols);
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, _NET_WM_PID,
+                        XCB_ATOM_CARDINAL, 32, 1, &pid);
+    set_title(window, i);
+    return window;
+}
+
+/* map the window and wait until wmd has focused it, or give up */
+long long map_and_focus(xcb_window_t window) {
+    long long start = get_time_us();
+    xcb_generic_event_t *event;
+    bool focused = false;
+
+    xcb_map_window(connection, window);
+    xcb_flush(connection);
+    while (!focused && get_time_us() - start < FOCUS_TIMEOUT) {
+        if (!(event = xcb_poll_for_event(connection))) {
+            usleep(50);
+            continue;
+        }
+        if ((event->response_type & ~0x80) == XCB_FOCUS_IN &&
+            ((xcb_focus_in_event_t *) event)->event == window) {
+            focused = true;
+        }
+        free(event);
+    }
+    return focused ? get_time_us() - start : -1;
+}
+
+/* run a command, returning its latency or -1 if it failed */
+long long command(int argc, char *argv[]) {
+    long long start = get_time_us();
+    char *output;
+    size_t length;
+    int status;
+
+    status = wmc_command(conn, argc, argv, &output, &length);
+    if (status == -1) {
+        die("wmd went away");
+    }
+    free(output);
+    return status ? -1 : get_time_us() - start;
+}
+
+/* wait until wmd has handled everything sent to it so far: the server has
+ * processed our requests, and a command round trip lets wmd read the
+ * events they caused */
+void settle() {
+    char *args[] = { "stats" };
+
+    sync_connection();
+    command(1, args);
+    command(1, args);
+}
+
+int main(int argc, char *argv[]) {
+    int nwindows = argc > 1 ? atoi(argv[1]) : 100;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    xcb_window_t *windows;
+    long long *latencies;
+    int nlatencies;
+    long long start;
+    long long elapsed;
+    char window_arg[16];
+    char *output = NULL;
+    size_t length;
+
+    if (nwindows < 1 || rounds < 1) {
+        die("usage: wmbench [windows] [rounds]");
+    }
+    connection = xcb_connect(NULL, NULL);
+    if (xcb_connection_has_error(connection)) {
+        die("can't open display");
+    }
+    screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+    if (!(conn = wmc_connect())) {
+        die("can't connect to wmd");
+    }
+    WM_PROTOCOLS = intern_atom("WM_PROTOCOLS");
+    WM_DELETE_WINDOW = intern_atom("WM_DELETE_WINDOW");
+    WM_TAKE_FOCUS = intern_atom("WM_TAKE_FOCUS");
+    _NET_WM_NAME = intern_atom("_NET_WM_NAME");
+    _NET_WM_PID = intern_atom("_NET_WM_PID");
+    UTF8_STRING = intern_atom("UTF8_STRING");
+
+    windows = malloc(nwindows * sizeof(*windows));
+    /* enough for the most samples any one measurement takes */
+    latencies = malloc(rounds * (nwindows > 10 ? nwindows : 10) * sizeof(*latencies));
+    printf("windows\t%d\n", nwindows);
+    printf("rounds\t%d\n", rounds);
+
+    command(2, (char *[]) { "stats", "reset" });
+
+    /* map to focus, one window at a time as a user would open them */
+    nlatencies = 0;
+    for (int i = 0; i < nwindows; i++) {
+        windows[i] = create_window(i);
+        if ((latencies[nlatencies] = map_and_focus(windows[i])) >= 0) {
+            nlatencies++;
+        }
+    }
+    printf("map_focus_timeouts\t%d\n", nwindows - nlatencies);
+    print_latencies("map_to_focus", latencies, nlatencies);
+
+    /* the windows command, which every status bar polls */
+    nlatencies = 0;
+    for (int i = 0; i < rounds * 10; i++) {
+        if ((latencies[nlatencies] = command(1, (char *[]) { "windows" })) >= 0) {
+            nlatencies++;
+        }
+    }
+    print_latencies("windows", latencies, nlatencies);
+
+    /* tile every window into alternating halves */
+    nlatencies = 0;
+    start = get_time_us();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < nwindows; i++) {
+            snprintf(window_arg, sizeof(window_arg), "0x%08x", windows[i]);
+            latencies[nlatencies] = command(4, (char *[]) {
+                "tile", "2x1", (round + i) % 2 ? "1x1+1+0" : "1x1+0+0", window_arg
+            });
+            if (latencies[nlatencies] >= 0) {
+                nlatencies++;
+            }
+        }
+    }
+    elapsed = get_time_us() - start;
+    printf("tile_per_s\t%lld\n", elapsed ? nlatencies * 1000000LL / elapsed : 0);
+    print_latencies("tile", latencies, nlatencies);
+
+    /* titles changing as fast as a busy terminal changes them */
+    start = get_time_us();
+    for (int round = 0; round < rounds * 10; round++) {
+        for (int i = 0; i < nwindows; i++) {
+            set_title(windows[i], round);
+        }
+        xcb_flush(connection);
+    }
+    settle();
+    elapsed = get_time_us() - start;
+    printf("title_changes_per_s\t%lld\n",
+           elapsed ? rounds * 10LL * nwindows * 1000000LL / elapsed : 0);
+
+    /* clients insisting on their own size, as games and players do */
+    start = get_time_us();
+    for (int round = 0; round < rounds * 10; round++) {
+        for (int i = 0; i < nwindows; i++) {
+            uint32_t size[] = { 320 + round % 2 * 8, 240 + round % 2 * 8 };
+            xcb_configure_window(connection, windows[i],
+                                 XCB_CONFIG_WINDOW_WIDTH|XCB_CONFIG_WINDOW_HEIGHT, size);
+        }
+        xcb_flush(connection);
+    }
+    settle();
+    elapsed = get_time_us() - start;
+    printf("configure_requests_per_s\t%lld\n",
+           elapsed ? rounds * 10LL * nwindows * 1000000LL / elapsed : 0);
+
+    /* what all of that cost wmd, per event type and command */
+    if (wmc_command(conn, 1, (char *[]) { "stats" }, &output, &length) == 0) {
+        fwrite(output, 1, length, stdout);
+    }
+    free(output);
+
+    for (int i = 0; i < nwindows; i++) {
+        xcb_destroy_window(connection, windows[i]);
+    }
+    xcb_flush(connection);
+    free(latencies);
+    free(windows);
+    wmc_disconnect(conn);
+    xcb_disconnect(connection);
+
+    return EXIT_SUCCESS;
+}
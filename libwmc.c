@@ -0,0 +1,485 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "wmc.h"
+
+struct WmcConnection
+{
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_size;
+    unsigned long seq;
+};
+
+struct WmcSnapshot
+{
+    int fd;
+    WmcSnapshotHeader *header;
+    size_t size;
+};
+
+/* read more of the stream into the input buffer */
+static int fill(WmcConnection *conn)
+{
+    int n;
+
+    if (conn->in_len == conn->in_size)
+    {
+        conn->in_size *= 2;
+        conn->in = realloc(conn->in, conn->in_size);
+    }
+    n = recv(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len, 0);
+    if (n <= 0)
+    {
+        return -1;
+    }
+    conn->in_len += n;
+    return n;
+}
+
+static void consume(WmcConnection *conn, size_t length)
+{
+    conn->in_len -= length;
+    memmove(conn->in, conn->in + length, conn->in_len);
+}
+
+/* Parse the "<seq> <status> <length>\n" header at the start of the buffer.
+ * Returns the status with the header and output lengths, or -1 if the
+ * whole frame isn't buffered yet. */
+static int parse_frame(WmcConnection *conn, unsigned long *seq, size_t *header, size_t *length)
+{
+    char *newline;
+    char line[64];
+    char status;
+
+    /* the buffer isn't NUL terminated, so only the header line is parsed */
+    if (!(newline = memchr(conn->in, '\n', conn->in_len)) ||
+        (size_t) (newline - conn->in) >= sizeof(line))
+    {
+        return -1;
+    }
+    *header = newline - conn->in + 1;
+    memcpy(line, conn->in, *header - 1);
+    line[*header - 1] = '\0';
+    if (sscanf(line, "%lu %c %zu", seq, &status, length) != 3)
+    {
+        return -1;
+    }
+    if (conn->in_len < *header + *length)
+    {
+        return -1;
+    }
+    return status - '0';
+}
+
+static int send_all(int fd, char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* NUL terminated arguments, ended by an empty one */
+static size_t add_message(char **buf, size_t *size, size_t len, int argc, char *argv[])
+{
+    for (int i = 0; i <= argc; i++)
+    {
+        char *arg = i < argc ? argv[i] : "";
+        size_t arg_len = strlen(arg) + 1;
+        while (len + arg_len > *size)
+        {
+            *size *= 2;
+            *buf = realloc(*buf, *size);
+        }
+        memcpy(*buf + len, arg, arg_len);
+        len += arg_len;
+    }
+    return len;
+}
+
+void wmc_disconnect(WmcConnection *conn)
+{
+    if (conn->fd != -1)
+    {
+        close(conn->fd);
+    }
+    free(conn->in);
+    free(conn);
+}
+
+int wmc_fd(WmcConnection *conn)
+{
+    return conn->fd;
+}
+
+/* write a whole message, blocking until it is sent */
+static int send_message(WmcConnection *conn, int argc, char *argv[])
+{
+    size_t size = 1024;
+    char *buf = malloc(size);
+    size_t len;
+    int ret;
+
+    len = add_message(&buf, &size, 0, argc, argv);
+    ret = send_all(conn->fd, buf, len);
+    free(buf);
+    return ret;
+}
+
+unsigned long wmc_send(WmcConnection *conn, int argc, char *argv[])
+{
+    char **args = malloc((argc + 1) * sizeof(char *));
+    char seq[24];
+    int ret;
+
+    /* each command in a session is prefixed with its sequence number */
+    snprintf(seq, sizeof(seq), "%lu", conn->seq + 1);
+    args[0] = seq;
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    ret = send_message(conn, argc + 1, args);
+    free(args);
+    if (ret == -1)
+    {
+        return 0;
+    }
+    return ++conn->seq;
+}
+
+int wmc_pending(WmcConnection *conn)
+{
+    unsigned long seq;
+    size_t header;
+    size_t length;
+
+    return parse_frame(conn, &seq, &header, &length) != -1;
+}
+
+int wmc_receive(WmcConnection *conn, unsigned long *seq, char **output, size_t *length)
+{
+    unsigned long frame_seq;
+    size_t header;
+    size_t frame_length;
+    int status;
+
+    while ((status = parse_frame(conn, &frame_seq, &header, &frame_length)) == -1)
+    {
+        if (fill(conn) == -1)
+        {
+            return -1;
+        }
+    }
+    if (output)
+    {
+        *output = malloc(frame_length + 1);
+        memcpy(*output, conn->in + header, frame_length);
+        (*output)[frame_length] = '\0';
+    }
+    if (length)
+    {
+        *length = frame_length;
+    }
+    if (seq)
+    {
+        *seq = frame_seq;
+    }
+    consume(conn, header + frame_length);
+    return status;
+}
+
+WmcConnection *wmc_connect_path(const char *path)
+{
+    WmcConnection *conn;
+    struct sockaddr_un sock_addr;
+    char *session[] = { "session" };
+
+    sock_addr.sun_family = AF_UNIX;
+    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s", path);
+
+    conn = calloc(1, sizeof(WmcConnection));
+    conn->in_size = 1024;
+    conn->in = malloc(conn->in_size);
+    if ((conn->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        connect(conn->fd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == -1 ||
+        send_message(conn, 1, session) == -1 ||
+        wmc_receive(conn, NULL, NULL, NULL) != 0)
+    {
+        wmc_disconnect(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/* the socket of the wmd serving $DISPLAY, followed by suffix */
+static int get_socket_path(char *path, size_t size, const char *suffix)
+{
+    char *dpy;
+    char *sock_dir;
+
+    if (!(dpy = getenv("DISPLAY")))
+    {
+        return -1;
+    }
+    if (!(sock_dir = getenv("XDG_RUNTIME_DIR")))
+    {
+        sock_dir = "/tmp";
+    }
+    snprintf(path, size, "%s/wmd%s%s", sock_dir, dpy + 1, suffix);
+    return 0;
+}
+
+WmcConnection *wmc_connect(void)
+{
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+    if (get_socket_path(path, sizeof(path), "") == -1)
+    {
+        return NULL;
+    }
+    return wmc_connect_path(path);
+}
+
+int wmc_command(WmcConnection *conn, int argc, char *argv[], char **output, size_t *length)
+{
+    if (!wmc_send(conn, argc, argv))
+    {
+        return -1;
+    }
+    return wmc_receive(conn, NULL, output, length);
+}
+
+/* split off the next tab separated field */
+static char *next_field(char **line)
+{
+    char *field = *line;
+    char *tab;
+
+    if ((tab = strchr(field, '\t')))
+    {
+        *tab = '\0';
+        *line = tab + 1;
+    }
+    else
+    {
+        *line = field + strlen(field);
+    }
+    return field;
+}
+
+/* parse lines of window output, consuming the text */
+static int parse_windows(char *output, WmcWindow **windows)
+{
+    char *line;
+    char *end;
+    int nwindows = 0;
+    int size = 16;
+
+    *windows = malloc(size * sizeof(WmcWindow));
+    for (line = output; (end = strchr(line, '\n')); line = end + 1)
+    {
+        WmcWindow *window;
+        char *flags;
+
+        *end = '\0';
+        if (nwindows == size)
+        {
+            size *= 2;
+            *windows = realloc(*windows, size * sizeof(WmcWindow));
+        }
+        window = &(*windows)[nwindows++];
+        window->window = strtoul(next_field(&line), NULL, 16);
+        flags = next_field(&line);
+        snprintf(window->flags, sizeof(window->flags), "%s", strcmp(flags, " ") ? flags : "");
+        window->width = atoi(next_field(&line));
+        window->height = atoi(next_field(&line));
+        window->x = atoi(next_field(&line));
+        window->y = atoi(next_field(&line));
+        window->pid = atoi(next_field(&line));
+        window->instance = strdup(next_field(&line));
+        window->class = strdup(next_field(&line));
+        window->name = strdup(line);
+    }
+    free(output);
+    return nwindows;
+}
+
+int wmc_get_windows(WmcConnection *conn, WmcWindow **windows)
+{
+    char *argv[] = { "windows" };
+    char *output;
+
+    if (wmc_command(conn, 1, argv, &output, NULL) != 0)
+    {
+        return -1;
+    }
+    return parse_windows(output, windows);
+}
+
+void wmc_free_windows(WmcWindow *windows, int nwindows)
+{
+    for (int i = 0; i < nwindows; i++)
+    {
+        free(windows[i].instance);
+        free(windows[i].class);
+        free(windows[i].name);
+    }
+    free(windows);
+}
+
+int wmc_subscribe(WmcConnection *conn, int argc, char *argv[])
+{
+    char **args = malloc((argc + 1) * sizeof(char *));
+    int status;
+
+    args[0] = "subscribe";
+    memcpy(args + 1, argv, argc * sizeof(char *));
+    status = wmc_command(conn, argc + 1, args, NULL, NULL);
+    free(args);
+    return status;
+}
+
+int wmc_read_event(WmcConnection *conn, char **line)
+{
+    char *newline;
+    int length;
+
+    while (!(newline = memchr(conn->in, '\n', conn->in_len)))
+    {
+        if (fill(conn) == -1)
+        {
+            return -1;
+        }
+    }
+    length = newline - conn->in;
+    *line = malloc(length + 1);
+    memcpy(*line, conn->in, length);
+    (*line)[length] = '\0';
+    consume(conn, length + 1);
+    return length;
+}
+
+WmcSnapshot *wmc_open_snapshot(void)
+{
+    WmcSnapshot *snapshot;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path) + sizeof(WMC_SNAPSHOT_SUFFIX)];
+    struct stat st;
+    void *map;
+
+    if (get_socket_path(path, sizeof(path), WMC_SNAPSHOT_SUFFIX) == -1)
+    {
+        return NULL;
+    }
+    snapshot = calloc(1, sizeof(WmcSnapshot));
+    if ((snapshot->fd = open(path, O_RDONLY|O_CLOEXEC)) != -1 &&
+        fstat(snapshot->fd, &st) != -1 &&
+        (size_t) st.st_size >= sizeof(WmcSnapshotHeader) &&
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, snapshot->fd, 0)) != MAP_FAILED)
+    {
+        snapshot->header = map;
+        snapshot->size = st.st_size;
+    }
+    if (!snapshot->size || snapshot->header->magic != WMC_SNAPSHOT_MAGIC)
+    {
+        wmc_close_snapshot(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+void wmc_close_snapshot(WmcSnapshot *snapshot)
+{
+    if (snapshot->size)
+    {
+        munmap(snapshot->header, snapshot->size);
+    }
+    if (snapshot->fd != -1)
+    {
+        close(snapshot->fd);
+    }
+    free(snapshot);
+}
+
+/* follow wmd growing the file past our mapping */
+static int remap_snapshot(WmcSnapshot *snapshot)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(snapshot->fd, &st) == -1 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, snapshot->fd, 0)) == MAP_FAILED)
+    {
+        return -1;
+    }
+    munmap(snapshot->header, snapshot->size);
+    snapshot->header = map;
+    snapshot->size = st.st_size;
+    return 0;
+}
+
+int wmc_read_snapshot(WmcSnapshot *snapshot, char **text, size_t *length)
+{
+    uint32_t sequence;
+    uint32_t text_length;
+
+    *text = NULL;
+    for (int tries = 0; tries < 1000; tries++)
+    {
+        sequence = __atomic_load_n(&snapshot->header->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        text_length = snapshot->header->length;
+        if (sizeof(WmcSnapshotHeader) + text_length > snapshot->size)
+        {
+            if (remap_snapshot(snapshot) == -1)
+            {
+                break;
+            }
+            continue;
+        }
+        *text = realloc(*text, text_length + 1);
+        memcpy(*text, snapshot->header + 1, text_length);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snapshot->header->sequence, __ATOMIC_RELAXED) == sequence)
+        {
+            (*text)[text_length] = '\0';
+            if (length)
+            {
+                *length = text_length;
+            }
+            return 0;
+        }
+    }
+    free(*text);
+    *text = NULL;
+    return -1;
+}
+
+int wmc_get_snapshot_windows(WmcSnapshot *snapshot, WmcWindow **windows)
+{
+    char *text;
+
+    if (wmc_read_snapshot(snapshot, &text, NULL) == -1)
+    {
+        return -1;
+    }
+    return parse_windows(text, windows);
+}
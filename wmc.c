@@ -7,82 +7,171 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <string.h>
 
+#include "wmc.h"
+
 void die(const char *error)
 {
     fprintf(stderr, "%s\n", error);
     exit(EXIT_FAILURE);
 }
 
-int main(int argc, char *argv[])
+/* split a line into arguments in place, honouring quotes and backslashes */
+int split_line(char *line, char **args, int max_args)
 {
-    char* dpy;
-    char *sock_dir;
-    int sock_fd;
-    struct sockaddr_un sock_addr;
+    int nargs = 0;
+    char *in = line;
+    char *out = line;
 
-    if (argc == 1)
+    while (*in)
     {
-        die("");
+        while (*in == ' ' || *in == '\t')
+            in++;
+        if (!*in || nargs == max_args)
+            break;
+        args[nargs++] = out;
+        char quote = '\0';
+        for (; *in && (quote || (*in != ' ' && *in != '\t')); in++)
+        {
+            if (quote && *in == quote)
+                quote = '\0';
+            else if (!quote && (*in == '\'' || *in == '"'))
+                quote = *in;
+            else if (*in == '\\' && in[1] && quote != '\'')
+                *out++ = *++in;
+            else
+                *out++ = *in;
+        }
+        if (*in)
+            in++;
+        *out++ = '\0';
     }
+    return nargs;
+}
 
-    if (!(dpy = getenv("DISPLAY")))
-        die("");
+/* Send every line of stdin as a command over one session and print the
+ * responses as they arrive. Commands are pipelined, so a slow command
+ * doesn't hold up reading the ones after it. */
+int batch(WmcConnection *conn)
+{
+    char line[4096];
+    int line_len = 0;
+    char *args[256];
+    int nargs;
+    unsigned long sent = 0;
+    unsigned long received = 0;
+    bool input = true;
+    int ret = 0;
+    char *output;
+    size_t length;
+    struct pollfd fds[2];
 
-    if (!(sock_dir = getenv("XDG_RUNTIME_DIR")))
-        sock_dir = "/tmp";
+    fds[0].events = POLLIN;
+    fds[1].fd = wmc_fd(conn);
+    fds[1].events = POLLIN;
 
-    sock_addr.sun_family = AF_UNIX;
-    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s/wmd%s", sock_dir, dpy + 1);
-    sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (connect(sock_fd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == 1)
+    while (input || received < sent)
     {
-        die("");
-    }
-
-    int size = 1024;
-    char *buf;
-    int len = 0;
+        fds[0].fd = input ? STDIN_FILENO : -1;
+        if (poll(fds, 2, -1) == -1)
+            break;
 
-    buf =  malloc(size);
+        if (fds[0].revents)
+        {
+            int n = read(STDIN_FILENO, line + line_len, sizeof(line) - line_len - 1);
+            if (n > 0)
+                line_len += n;
+            else
+                input = false;
+            /* an unterminated last line, or one too long, is taken as is */
+            if (!input || line_len == sizeof(line) - 1)
+                line[line_len++] = '\n';
 
-    for (int i = 1; i < argc; i++)
-    {
-        int j = 0;
-        do {
-            if (len == size)
+            char *start = line;
+            char *end;
+            while ((end = memchr(start, '\n', line_len - (start - line))))
             {
-                size *= 2;
-                buf = realloc(buf, size);
+                *end = '\0';
+                nargs = split_line(start, args, sizeof(args) / sizeof(*args));
+                start = end + 1;
+                if (!nargs || args[0][0] == '#')
+                    continue;
+                if (!wmc_send(conn, nargs, args))
+                    die("");
+                sent++;
             }
-            buf[len] = argv[i][j++];
-        } while (buf[len++] != '\0');
+            line_len -= start - line;
+            memmove(line, start, line_len);
+            if (!input)
+                shutdown(wmc_fd(conn), SHUT_WR);
+        }
+
+        if (fds[1].revents)
+        {
+            do {
+                int status = wmc_receive(conn, NULL, &output, &length);
+                if (status == -1)
+                    return 1;
+                fwrite(output, 1, length, stdout);
+                fflush(stdout);
+                free(output);
+                if (status != 0)
+                    ret = 1;
+                received++;
+            } while (received < sent && wmc_pending(conn));
+        }
     }
 
-    if (send(sock_fd, buf, len, 0) == -1)
+    if (received < sent)
+        ret = 1;
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    WmcConnection *conn;
+    char *output;
+    size_t length;
+    int ret;
+
+    if (argc == 1)
     {
-        /* die("") */
+        die("");
     }
 
-    int ret = -1;
+    if (!(conn = wmc_connect()))
+    {
+        die("");
+    }
 
-    while ((len = recv(sock_fd, buf, size, 0)) > 0)
+    if (!strcmp(argv[1], "-i") || !strcmp(argv[1], "--batch"))
     {
-        if (ret == -1 && len >= 1)
-        {
-            ret = buf[0] - 48;
-            fwrite(buf + 1, 1, len - 1, stdout);
-        }
-        else
+        ret = batch(conn);
+    }
+    else if (!strcmp(argv[1], "subscribe"))
+    {
+        char *line;
+        if ((ret = wmc_subscribe(conn, argc - 2, argv + 2)) == 0)
         {
-            fwrite(buf, 1, len, stdout);
+            while (wmc_read_event(conn, &line) != -1)
+            {
+                printf("%s\n", line);
+                fflush(stdout);
+                free(line);
+            }
         }
     }
+    else if ((ret = wmc_command(conn, argc - 1, argv + 1, &output, &length)) != -1)
+    {
+        fwrite(output, 1, length, stdout);
+        free(output);
+    }
 
-    free(buf);
-    close(sock_fd);
+    wmc_disconnect(conn);
 
     if (ret == -1)
     {
@@ -0,0 +1,88 @@
+#ifndef WMC_H
+#define WMC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct WmcConnection WmcConnection;
+typedef struct WmcSnapshot WmcSnapshot;
+
+/* wmd keeps the windows output, without the pointer flag, in a file next
+ * to its socket. The sequence is odd while the text is being rewritten, so
+ * a copy taken between two reads of the same even sequence is consistent. */
+#define WMC_SNAPSHOT_SUFFIX ".windows"
+#define WMC_SNAPSHOT_MAGIC 0x776d6473
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    /* of the whole file */
+    uint32_t size;
+    /* of the text following the header */
+    uint32_t length;
+} WmcSnapshotHeader;
+
+/* one line of the windows command output */
+typedef struct {
+    unsigned int window;
+    char flags[8];
+    int width;
+    int height;
+    int x;
+    int y;
+    int pid;
+    char *instance;
+    char *class;
+    char *name;
+} WmcWindow;
+
+/* Connect to the wmd serving $DISPLAY and open a session on it, or NULL */
+WmcConnection *wmc_connect(void);
+WmcConnection *wmc_connect_path(const char *path);
+void wmc_disconnect(WmcConnection *conn);
+
+/* the socket, for polling alongside other descriptors */
+int wmc_fd(WmcConnection *conn);
+
+/* Queue a command without waiting for its response. Responses come back
+ * in the order commands were sent, except that a wait is answered only
+ * once it is satisfied. Returns the sequence number, 0 on error. */
+unsigned long wmc_send(WmcConnection *conn, int argc, char *argv[]);
+
+/* Wait for the next response and the sequence number of its command.
+ * Returns the command status (0 on success) or -1 on error. The output is
+ * NUL terminated and freed by the caller. */
+int wmc_receive(WmcConnection *conn, unsigned long *seq, char **output, size_t *length);
+
+/* nonzero if a complete response is buffered and wmc_receive won't block */
+int wmc_pending(WmcConnection *conn);
+
+/* wmc_send followed by wmc_receive, with no other command in flight */
+int wmc_command(WmcConnection *conn, int argc, char *argv[], char **output, size_t *length);
+
+/* Run the windows command and parse its output, root window last.
+ * Returns the number of windows or -1 on error. */
+int wmc_get_windows(WmcConnection *conn, WmcWindow **windows);
+void wmc_free_windows(WmcWindow *windows, int nwindows);
+
+/* Turn the connection into an event stream. The arguments filter the event
+ * types delivered. Returns the command status or -1 on error. */
+int wmc_subscribe(WmcConnection *conn, int argc, char *argv[]);
+
+/* Wait for the next event line, without its newline. Returns its length
+ * or -1 on error. The line is freed by the caller. */
+int wmc_read_event(WmcConnection *conn, char **line);
+
+/* Map the snapshot of the wmd serving $DISPLAY, or NULL */
+WmcSnapshot *wmc_open_snapshot(void);
+void wmc_close_snapshot(WmcSnapshot *snapshot);
+
+/* Copy out the current windows output without talking to wmd. Returns 0,
+ * or -1 if no consistent copy could be taken. The text is NUL terminated
+ * and freed by the caller. */
+int wmc_read_snapshot(WmcSnapshot *snapshot, char **text, size_t *length);
+
+/* wmc_read_snapshot parsed like wmc_get_windows */
+int wmc_get_snapshot_windows(WmcSnapshot *snapshot, WmcWindow **windows);
+
+#endif
@@ -1,21 +1,31 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
-#include <X11/Xatom.h>
-#include <X11/Xlib.h>
-#include <X11/Xresource.h>
-#include <X11/Xutil.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "wmc.h"
 
 // TODO
 // WM_TRANSIENT_FOR https://tronche.com/gui/x/icccm/sec-4.html#WM_TRANSIENT_FOR
 
-/* https://tronche.com/gui/x/xlib/ */
+/* https://xcb.freedesktop.org/manual/ */
 /* https://tronche.com/gui/x/icccm/ */
 /* https://specifications.freedesktop.org/wm-spec/wm-spec-latest.html */
 
@@ -38,6 +48,14 @@ enum {
     wm_atoms_count
 };
 
+static const char *wm_atom_names[wm_atoms_count] = {
+    "WM_PROTOCOLS",
+    "WM_STATE",
+    "WM_CHANGE_STATE",
+    "WM_DELETE_WINDOW",
+    "WM_TAKE_FOCUS"
+};
+
 enum {
     _NET_SUPPORTED,
     _NET_ACTIVE_WINDOW,
@@ -57,38 +75,279 @@ enum {
     net_atoms_count
 };
 
+static const char *net_atom_names[net_atoms_count] = {
+    "_NET_SUPPORTED",
+    "_NET_ACTIVE_WINDOW",
+    "_NET_WM_NAME",
+    "_NET_WM_PID",
+    "_NET_SUPPORTING_WM_CHECK",
+    "_NET_WM_STATE",
+    "_NET_WM_STATE_ABOVE",
+    "_NET_WM_STATE_DEMANDS_ATTENTION",
+    "_NET_WM_STATE_FULLSCREEN",
+    "_NET_WM_WINDOW_TYPE",
+    "_NET_WM_WINDOW_TYPE_DIALOG",
+    "_NET_WM_WINDOW_TYPE_DOCK",
+    "_NET_WM_WINDOW_TYPE_SPLASH"
+};
+
+/* ICCCM WM_STATE values */
+enum {
+    WithdrawnState = 0,
+    NormalState = 1,
+    IconicState = 3
+};
+
+/* ICCCM WM_HINTS and WM_NORMAL_HINTS flags */
+#define StateHint   (1L << 1)
+#define PPosition   (1L << 2)
+#define PSize       (1L << 3)
+#define PMaxSize    (1L << 5)
+#define PResizeInc  (1L << 6)
+#define PAspect     (1L << 7)
+
 #define MWM_HINTS_DECORATIONS (1L << 1)
 
 typedef struct {
-    unsigned long flags;
-    unsigned long functions;
-    unsigned long decorations;
-    long input_mode;
-    unsigned long status;
+    uint32_t flags;
+    uint32_t functions;
+    uint32_t decorations;
+    int32_t input_mode;
+    uint32_t status;
 } MotifWmHints;
 
+/* WM_SIZE_HINTS as laid out on the wire */
+typedef struct {
+    uint32_t flags;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    int32_t min_width;
+    int32_t min_height;
+    int32_t max_width;
+    int32_t max_height;
+    int32_t width_inc;
+    int32_t height_inc;
+    int32_t min_aspect_num;
+    int32_t min_aspect_den;
+    int32_t max_aspect_num;
+    int32_t max_aspect_den;
+    int32_t base_width;
+    int32_t base_height;
+    int32_t win_gravity;
+} SizeHints;
+
 enum {
     _NET_WM_STATE_REMOVE,
     _NET_WM_STATE_ADD,
     _NET_WM_STATE_TOGGLE
 };
 
-static Bool quit = False;
-static Bool restart = False;
+static bool quit = false;
+static bool restart = false;
 
 /* X */
-static Display *display;
-static int screen;
-static Window root;
+static xcb_connection_t *connection;
+static xcb_screen_t *screen;
+static xcb_window_t root;
 static int screen_width;
 static int screen_height;
-static Atom wm_atoms[wm_atoms_count];
-static Atom net_atoms[net_atoms_count];
-static Atom _MOTIF_WM_HINTS;
+static xcb_atom_t wm_atoms[wm_atoms_count];
+static xcb_atom_t net_atoms[net_atoms_count];
+static xcb_atom_t _MOTIF_WM_HINTS;
+static xcb_atom_t UTF8_STRING;
+
+/* counters reported by the stats command */
+static struct {
+    unsigned long events;
+    unsigned long commands;
+    /* the baseline ended every event and command with an XSync */
+    unsigned long syncs_saved;
+    unsigned long events_dropped;
+    /* geometry and state requests not sent, the window having them already */
+    unsigned long writes_saved;
+    /* from starting to serving, after adopting the existing windows */
+    unsigned long ready_ms;
+} stats;
+
+/* replies waited on, whether or not they had arrived already; never reset,
+ * as handlers are charged the difference across them */
+static unsigned long replies_waited = 0;
+
+/* Log-linear buckets of microseconds, four to each power of two, so a
+ * latency below 7 * 2^30 us, about two hours, is known to within a
+ * quarter; longer ones all go in the last bucket */
+#define LATENCY_BUCKETS 128
+
+/* what one kind of event or command costs, for the stats command */
+typedef struct {
+    unsigned long count;
+    unsigned long requests;
+    unsigned long replies;
+    unsigned long latency[LATENCY_BUCKETS];
+    unsigned long max_latency;
+} HandlerStats;
+
+/* a handler being measured, see start_measure() */
+typedef struct {
+    long long start;
+    unsigned int sequence;
+    unsigned long replies;
+} Measure;
+
+static const char *event_type_names[128] = {
+    [XCB_KEY_PRESS] = "KeyPress",
+    [XCB_BUTTON_PRESS] = "ButtonPress",
+    [XCB_FOCUS_IN] = "FocusIn",
+    [XCB_FOCUS_OUT] = "FocusOut",
+    [XCB_CREATE_NOTIFY] = "CreateNotify",
+    [XCB_DESTROY_NOTIFY] = "DestroyNotify",
+    [XCB_UNMAP_NOTIFY] = "UnmapNotify",
+    [XCB_MAP_NOTIFY] = "MapNotify",
+    [XCB_MAP_REQUEST] = "MapRequest",
+    [XCB_REPARENT_NOTIFY] = "ReparentNotify",
+    [XCB_CONFIGURE_NOTIFY] = "ConfigureNotify",
+    [XCB_CONFIGURE_REQUEST] = "ConfigureRequest",
+    [XCB_CIRCULATE_NOTIFY] = "CirculateNotify",
+    [XCB_CIRCULATE_REQUEST] = "CirculateRequest",
+    [XCB_PROPERTY_NOTIFY] = "PropertyNotify",
+    [XCB_CLIENT_MESSAGE] = "ClientMessage",
+    [XCB_MAPPING_NOTIFY] = "MappingNotify"
+};
+static HandlerStats event_stats[128];
+
+/* commands are told apart by name, the rest counted together as "other" */
+static const char *command_names[] = {
+    "quit", "restart", "windows", "activate", "tile", "autolayout", "layout",
+    "delete", "fullscreen", "iconify", "stats", "trace", "other"
+};
+#define COMMAND_COUNT (sizeof(command_names) / sizeof(*command_names))
+static HandlerStats command_stats[COMMAND_COUNT];
+
+/* Spans of handlers, X round trips and the work between them, kept in a
+ * ring while tracing is on and dumped as Chrome trace JSON */
+#define TRACE_SPANS (1<<16)
+
+typedef struct {
+    const char *category;
+    const char *name;
+    long long start;
+    long long duration;
+} Span;
+
+static bool tracing = false;
+static Span *spans = NULL;
+static unsigned int spans_start = 0;
+static unsigned int spans_len = 0;
 
 static char *prefix = "W";
 static FILE *fifo = NULL;
 
+#define TIMER_TICK 10
+#define TIMER_SLOTS 256
+
+typedef struct Timer Timer;
+
+/* deferred work, kept in a timer wheel of TIMER_SLOTS slots of TIMER_TICK
+ * milliseconds each and driven by a timerfd armed once for the earliest
+ * expiry, so an idle wm isn't woken */
+struct Timer {
+    long long expiry;
+    void (*callback)(Timer *timer);
+    bool pending;
+    Timer *prev;
+    Timer *next;
+};
+
+static Timer *timer_wheel[TIMER_SLOTS];
+static long long timer_tick;
+static int ntimers = 0;
+/* the expiry the timerfd is armed for, or 0 */
+static long long timer_armed = 0;
+
+/* the reactor's own descriptors; their addresses tag them in epoll */
+static int epoll_fd;
+static int timer_fd;
+static int x_fd;
+static int sock_fd;
+
+static void title_timeout(Timer *timer);
+
+/* title changes are coalesced per batch and written at most every
+ * title_interval milliseconds */
+static Timer title_timer = { .callback = title_timeout };
+static bool titles_changed = false;
+static int title_interval = 0;
+static long long title_time = 0;
+
+static xcb_window_t active_window = XCB_WINDOW_NONE;
+
+#define PEER_BUFFER_MAX (1 << 20)
+#define SUBSCRIBER_BUFFER (1 << 16)
+
+/* event types a subscriber can filter on */
+enum { EVENT_ACTIVE, EVENT_TITLE, EVENT_ROOT, EVENT_COUNT };
+static const char *event_names[EVENT_COUNT] = { "active", "title", "root" };
+
+typedef struct Peer Peer;
+
+/* a connection on the control socket, read and written without blocking */
+struct Peer {
+    int fd;
+    char *in;
+    size_t in_len;
+    size_t in_size;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    /* close once the output is written and any waits are answered */
+    bool closing;
+    /* the client can't read any more, so nothing is kept for it */
+    bool hung_up;
+    /* many framed commands per connection, see handle_messages() */
+    bool session;
+    /* an event stream, fed through a bounded ring by publish_event() */
+    bool subscribed;
+    unsigned int event_mask;
+    char *ring;
+    size_t ring_start;
+    size_t ring_len;
+    unsigned long dropped;
+    uint32_t events;
+    Peer *next;
+};
+
+static Peer *peers = NULL;
+
+/* conditions on a managed window, see parse_selector() */
+typedef struct {
+    xcb_window_t window;
+    char *instance;
+    char *class;
+    char *name;
+    int pid;
+    bool mapped;
+    char flags[FLAG_COUNT];
+} Selector;
+
+typedef struct Waiter Waiter;
+
+/* a wait command, answered once a window matches or the timer runs out */
+struct Waiter {
+    /* first, so wait_timeout() can get from the timer to the waiter */
+    Timer timer;
+    Peer *peer;
+    char seq[33];
+    bool session;
+    Selector selector;
+    /* windows that changed after this generation are still to be checked */
+    unsigned long since;
+    Waiter *next;
+};
+
+static Waiter *waiters = NULL;
+
 /* settings */
 static unsigned int foreground;
 static unsigned int background;
@@ -96,566 +355,2428 @@ static int border_size;
 static int gap_size;
 static int top_padding;
 
-static void iconify_window(Window window, Bool iconify);
-static void activate_window(Window window);
-static void raise_window(Window window);
-static void fullscreen_window(Window window);
+/* automatic layouts, see arrange_windows() */
+enum { LAYOUT_NONE, LAYOUT_MASTER, LAYOUT_GRID, LAYOUT_COLUMNS, LAYOUT_COUNT };
+static const char *layout_names[LAYOUT_COUNT] = { "none", "master", "grid", "columns" };
+static int auto_layout = LAYOUT_NONE;
+/* the wmd.layout resource last read, so a reload only applies a change */
+static char *layout_resource = NULL;
+static unsigned long map_count = 0;
 
-static int error_handler(Display *display, XErrorEvent *error) {
-    return 0;
+/* cells of a grid_width by grid_height grid over the screen */
+typedef struct {
+    int grid_width;
+    int grid_height;
+    int width;
+    int height;
+    int x;
+    int y;
+} Cell;
+
+/* stacking layers, from the bottom */
+enum { LAYER_NORMAL, LAYER_ABOVE };
+
+typedef struct Client Client;
+
+struct Client {
+    xcb_window_t window;
+    bool override_redirect;
+    bool manageable;
+    int map_state;
+    long wm_state;
+    xcb_atom_t *states;
+    int nstates;
+    /* follows _NET_WM_STATE_ABOVE in states */
+    int layer;
+    xcb_atom_t type;
+    int border_width;
+    /* WM_NORMAL_HINTS and _MOTIF_WM_HINTS, fetched when first needed and
+     * dropped on PropertyNotify */
+    bool hints_cached;
+    SizeHints hints;
+    bool motif_cached;
+    bool undecorated;
+    /* WM_PROTOCOLS, likewise */
+    bool protocols_cached;
+    xcb_atom_t *protocols;
+    int nprotocols;
+    /* our own property writes whose PropertyNotify is still to come */
+    int wm_state_writes;
+    int net_wm_state_writes;
+    bool title_changed;
+    /* what window output shows, refetched by refresh_clients() when stale */
+    int x;
+    int y;
+    int width;
+    int height;
+    int pid;
+    char *instance;
+    char *class;
+    char *name;
+    bool stale;
+    /* in the windows output as of generation, with a line hashing to hash */
+    bool listed;
+    uint32_t hash;
+    unsigned long generation;
+    /* chains in the instance, class and pid indices */
+    bool indexed;
+    Client *instance_next;
+    Client *class_next;
+    Client *pid_next;
+    /* the order of mapping and the cells the window was last tiled in */
+    unsigned long map_order;
+    Cell cell;
+    Client *above;
+    Client *below;
+    Client *next;
+};
+
+#define CLIENT_BUCKETS 256
+
+/* every child of root, hashed by window and linked in stacking order */
+static Client *clients[CLIENT_BUCKETS];
+static Client *top_client = NULL;
+static Client *bottom_client = NULL;
+static bool clients_stale = false;
+
+/* clients hashed by WM_CLASS and _NET_WM_PID for selectors */
+static Client *instance_index[CLIENT_BUCKETS];
+static Client *class_index[CLIENT_BUCKETS];
+static Client *pid_index[CLIENT_BUCKETS];
+
+#define REMOVALS_MAX 1024
+
+/* bumped once per batch that changes the windows output; removals are
+ * remembered back to removals_floor for windows --since */
+static bool windows_dirty = true;
+static unsigned long generation = 0;
+static uint32_t root_hash = 0;
+static unsigned long root_generation = 0;
+static struct {
+    xcb_window_t window;
+    unsigned long generation;
+} removals[REMOVALS_MAX];
+static int nremovals = 0;
+static unsigned long removals_floor = 0;
+
+/* the windows output published for other processes, see write_snapshot() */
+static int snapshot_fd = -1;
+static WmcSnapshotHeader *snapshot = NULL;
+/* the generation the snapshot text was written at */
+static unsigned long snapshot_generation = 0;
+
+/* What a restart hands over to the new process, in a file next to the
+ * socket: the generations of the windows output and, per window, what
+ * can't be fetched from the server again. The sizes guard against a
+ * rebuilt wmd with a different layout. */
+#define HANDOFF_SUFFIX ".state"
+#define HANDOFF_MAGIC 0x776d6468
+
+typedef struct {
+    uint32_t magic;
+    uint32_t header_size;
+    uint32_t removal_size;
+    uint32_t client_size;
+    int screen_width;
+    int screen_height;
+    unsigned long generation;
+    unsigned long root_generation;
+    uint32_t root_hash;
+    unsigned long removals_floor;
+    int nremovals;
+    unsigned long map_count;
+    int nclients;
+} HandoffHeader;
+
+typedef struct {
+    xcb_window_t window;
+    bool listed;
+    uint32_t hash;
+    unsigned long generation;
+    unsigned long map_order;
+    Cell cell;
+} HandoffClient;
+
+static void iconify_window(xcb_window_t window, bool iconify);
+static void activate_window(xcb_window_t window);
+static void raise_window(xcb_window_t window);
+static void fullscreen_window(xcb_window_t window);
+static void reset_layout();
+static long long trace_start();
+static void trace_end(const char *category, const char *name, long long start);
+static void retile_windows();
+
+xcb_intern_atom_cookie_t request_atom(const char *name) {
+    return xcb_intern_atom(connection, 0, strlen(name), name);
 }
 
-void set_window_property(Window window, Atom property, Window value) {
-    XChangeProperty(display, window, property, XA_WINDOW, 32,
-                    PropModeReplace, (unsigned char *) &value, 1);
+xcb_atom_t get_intern_atom_reply(xcb_intern_atom_cookie_t cookie) {
+    xcb_intern_atom_reply_t *reply;
+    xcb_atom_t atom = XCB_ATOM_NONE;
+
+    replies_waited++;
+    if ((reply = xcb_intern_atom_reply(connection, cookie, NULL))) {
+        atom = reply->atom;
+        free(reply);
+    }
+    return atom;
+}
+
+void select_input(xcb_window_t window, uint32_t mask) {
+    xcb_change_window_attributes(connection, window, XCB_CW_EVENT_MASK, &mask);
+}
+
+void configure(xcb_window_t window, uint16_t mask, const uint32_t *values) {
+    xcb_configure_window(connection, window, mask, values);
 }
 
-unsigned char *get_property(Window window, Atom property, long length, Atom type) {
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *prop;
 
-    prop = NULL;
-    XGetWindowProperty(display, window, property, 0L, length, False, type,
-                       &actual_type, &actual_format, &nitems, &bytes_after, &prop);
-    return prop;
+void set_border_color(xcb_window_t window, uint32_t pixel) {
+    xcb_change_window_attributes(connection, window, XCB_CW_BORDER_PIXEL, &pixel);
+}
+
+void set_window_property(xcb_window_t window, xcb_atom_t property, xcb_window_t value) {
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, property,
+                        XCB_ATOM_WINDOW, 32, 1, &value);
 }
 
-Atom get_atom_property(Window window, Atom property) {
-    unsigned char *prop;
-    Atom atom;
+/* properties are requested first and their replies collected later, so that
+ * everything needed for a window costs a single round trip */
+xcb_get_property_cookie_t request_property(xcb_window_t window, xcb_atom_t property,
+                                           xcb_atom_t type, uint32_t length) {
+    return xcb_get_property(connection, 0, window, property, type, 0, length);
+}
 
-    atom = None;
-    prop = get_property(window, property, sizeof(atom), XA_ATOM);
-    if (prop) {
-        atom = *(Atom *)prop;
-        XFree(prop);
+/* the reply, or NULL if the property is missing, empty or of another format */
+xcb_get_property_reply_t *get_property_reply(xcb_get_property_cookie_t cookie, uint8_t format) {
+    xcb_get_property_reply_t *reply;
+    long long start = trace_start();
+
+    replies_waited++;
+    reply = xcb_get_property_reply(connection, cookie, NULL);
+    trace_end("x", "GetProperty", start);
+    if (reply &&
+        (reply->type == XCB_ATOM_NONE ||
+         (format && reply->format != format) ||
+         !xcb_get_property_value_length(reply))) {
+        free(reply);
+        reply = NULL;
     }
+    return reply;
+}
+
+xcb_atom_t get_atom_reply(xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply;
+    xcb_atom_t atom = XCB_ATOM_NONE;
 
+    if ((reply = get_property_reply(cookie, 32))) {
+        atom = *(xcb_atom_t *) xcb_get_property_value(reply);
+        free(reply);
+    }
     return atom;
 }
 
-int get_border_size(Window window) {
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    unsigned char *prop = NULL;
-    MotifWmHints *hints;
+/* a NUL terminated copy of a string property, or NULL */
+char *get_string_reply(xcb_get_property_cookie_t cookie, int *length) {
+    xcb_get_property_reply_t *reply;
+    char *string = NULL;
+    int string_length = 0;
+
+    if ((reply = get_property_reply(cookie, 8))) {
+        string_length = xcb_get_property_value_length(reply);
+        string = malloc(string_length + 1);
+        memcpy(string, xcb_get_property_value(reply), string_length);
+        string[string_length] = '\0';
+        free(reply);
+    }
+    if (length) {
+        *length = string_length;
+    }
+    return string;
+}
+
+xcb_atom_t get_atom_property(xcb_window_t window, xcb_atom_t property) {
+    return get_atom_reply(request_property(window, property, XCB_ATOM_ATOM, 1));
+}
+
+xcb_get_property_cookie_t request_motif_hints(xcb_window_t window) {
+    return request_property(window, _MOTIF_WM_HINTS, _MOTIF_WM_HINTS, 5);
+}
 
-    int size = border_size;
+/* whether the window asks to go without decorations, and so a border */
+bool get_undecorated_reply(xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply;
+    MotifWmHints *hints;
 
-    XGetWindowProperty(display, window, _MOTIF_WM_HINTS, 0L, 5, False, _MOTIF_WM_HINTS,
-                       &actual_type, &actual_format, &nitems, &bytes_after, &prop);
+    bool undecorated = false;
 
-    if (prop &&
-        actual_type == _MOTIF_WM_HINTS &&
-        actual_format == 32 &&
-        nitems == 5) {
-        hints = (MotifWmHints *) prop;
+    if ((reply = get_property_reply(cookie, 32)) &&
+        reply->type == _MOTIF_WM_HINTS &&
+        reply->value_len == 5) {
+        hints = (MotifWmHints *) xcb_get_property_value(reply);
         if (hints->flags & MWM_HINTS_DECORATIONS && hints->decorations == 0) {
-            size = 0;
+            undecorated = true;
         }
     }
 
-    if (prop) {
-        XFree(prop);
+    free(reply);
+
+    return undecorated;
+}
+
+xcb_get_property_cookie_t request_normal_hints(xcb_window_t window) {
+    return request_property(window, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS,
+                            sizeof(SizeHints) / 4);
+}
+
+void get_normal_hints_reply(xcb_get_property_cookie_t cookie, SizeHints *hints) {
+    xcb_get_property_reply_t *reply;
+    int length;
+
+    memset(hints, 0, sizeof(*hints));
+    if ((reply = get_property_reply(cookie, 32))) {
+        length = xcb_get_property_value_length(reply);
+        if (length > (int) sizeof(*hints)) {
+            length = sizeof(*hints);
+        }
+        memcpy(hints, xcb_get_property_value(reply), length);
+        free(reply);
     }
+}
 
-    return size;
+/* request whichever hints of the window its client doesn't have cached */
+void request_hints(Client *client,
+                   xcb_window_t window,
+                   xcb_get_property_cookie_t *hints_cookie,
+                   xcb_get_property_cookie_t *motif_cookie) {
+    hints_cookie->sequence = 0;
+    motif_cookie->sequence = 0;
+    if (!client || !client->hints_cached) {
+        *hints_cookie = request_normal_hints(window);
+    }
+    if (!client || !client->motif_cached) {
+        *motif_cookie = request_motif_hints(window);
+    }
 }
 
-Window get_active_window() {
-    unsigned char *prop;
-    Window window;
+/* the hints of the window, from the cookies of request_hints() or the cache */
+void get_hints_reply(Client *client,
+                     xcb_get_property_cookie_t hints_cookie,
+                     xcb_get_property_cookie_t motif_cookie,
+                     SizeHints *hints,
+                     bool *undecorated) {
+    if (hints_cookie.sequence) {
+        get_normal_hints_reply(hints_cookie, hints);
+        if (client) {
+            client->hints = *hints;
+            client->hints_cached = true;
+        }
+    } else {
+        *hints = client->hints;
+    }
+    if (motif_cookie.sequence) {
+        *undecorated = get_undecorated_reply(motif_cookie);
+        if (client) {
+            client->undecorated = *undecorated;
+            client->motif_cached = true;
+        }
+    } else {
+        *undecorated = client->undecorated;
+    }
+}
 
-    window = None;
-    prop = get_property(root, net_atoms[_NET_ACTIVE_WINDOW], sizeof(window), XA_WINDOW);
-    if (prop) {
-        window = *(Window *)prop;
-        XFree(prop);
+void get_client_hints(Client *client, SizeHints *hints) {
+    if (!client->hints_cached) {
+        get_normal_hints_reply(request_normal_hints(client->window), &client->hints);
+        client->hints_cached = true;
     }
+    *hints = client->hints;
+}
 
-    return window;
+long long get_time() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
-Window get_pointer_window() {
-    Window child;
-    int root_x;
-    int root_y;
-    int win_x;
-    int win_y;
-    unsigned int mask;
+long long get_time_us() {
+    struct timespec now;
 
-    XQueryPointer(display, root, &root, &child, &root_x, &root_y, &win_x, &win_y, &mask);
-    return child;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
 }
 
-void set_wm_state(Window window, long state) {
-    long data[] = { state, None };
+int get_latency_bucket(unsigned long latency) {
+    int exponent;
 
-    XChangeProperty(display, window, wm_atoms[WM_STATE], wm_atoms[WM_STATE], 32,
-                    PropModeReplace, (unsigned char *) data, 2);
+    if (latency < 4) {
+        return latency;
+    }
+    for (exponent = 2; exponent < LATENCY_BUCKETS / 4 && latency >> (exponent + 1); exponent++);
+    if (latency >> (exponent + 1)) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return 4 * (exponent - 1) + ((latency >> (exponent - 2)) & 3);
 }
 
-long get_wm_state(Window window) {
-    unsigned char *prop = NULL;
-    long state = -1;
+/* the largest latency that falls in the bucket */
+unsigned long get_bucket_latency(int bucket) {
+    int exponent = bucket / 4 + 1;
 
-    prop = get_property(window, wm_atoms[WM_STATE], 2L, wm_atoms[WM_STATE]);
-    if (prop) {
-        state = *prop;
-        XFree(prop);
+    if (bucket < 4) {
+        return bucket;
     }
-    return state;
+    return ((4UL + bucket % 4 + 1) << (exponent - 2)) - 1;
 }
 
-void set_net_wm_state(Window window, Atom state, Bool set) {
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    Atom *prop;
-
-    prop = NULL;
-    if (XGetWindowProperty(
-            display, window, net_atoms[_NET_WM_STATE], 0L, ~0L, False, XA_ATOM,
-            &actual_type, &actual_format, &nitems, &bytes_after, (unsigned char **) &prop) == Success &&
-        actual_type == XA_ATOM && actual_format == 32 && prop) {
-        Atom *states = malloc((nitems + (set ? 1 : 0)) * sizeof(Atom));
-        int nstates = 0;
-        unsigned long i;
-        for (i = 0; i < nitems; i++) {
-            if (prop[i] == state) {
-                if (set) {
-                    break;
-                }
-            } else {
-                states[nstates++] = prop[i];
-            }
-        }
-        if (i == nitems) {
-            if (set) {
-                states[nstates++] = state;
-            }
-            if (nstates) {
-                XChangeProperty(display, window, net_atoms[_NET_WM_STATE], XA_ATOM, 32,
-                                PropModeReplace, (unsigned char *) states, nstates);
-            } else {
-                XDeleteProperty(display, window, net_atoms[_NET_WM_STATE]);
-            }
+unsigned long get_percentile(HandlerStats *handler, int percent) {
+    unsigned long rank = (handler->count * percent + 99) / 100;
+    unsigned long seen = 0;
+
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        if ((seen += handler->latency[bucket]) >= rank) {
+            return get_bucket_latency(bucket) < handler->max_latency ?
+                   get_bucket_latency(bucket) : handler->max_latency;
         }
-        free(states);
-    } else if (set) {
-        XChangeProperty(display, window, net_atoms[_NET_WM_STATE], XA_ATOM, 32,
-                        PropModeReplace, (unsigned char *) &state, 1);
     }
+    return handler->max_latency;
+}
 
-    if (prop) {
-        XFree(prop);
-    }
+/* The requests a handler sends are counted from the sequence numbers of a
+ * NoOperation on either side of it, which the server discards unread. */
+void start_measure(Measure *measure) {
+    measure->sequence = xcb_no_operation(connection).sequence;
+    measure->replies = replies_waited;
+    measure->start = get_time_us();
 }
 
-Bool is_net_wm_state_set(Window window, Atom state) {
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems;
-    unsigned long bytes_after;
-    Atom *states;
-    Bool set = False;
+void end_measure(Measure *measure, HandlerStats *handler) {
+    unsigned long latency = get_time_us() - measure->start;
 
-    states = NULL;
-    if (XGetWindowProperty(
-            display, window, net_atoms[_NET_WM_STATE], 0L, ~0L, False, XA_ATOM,
-            &actual_type, &actual_format, &nitems, &bytes_after, (unsigned char **) &states) == Success &&
-        actual_type == XA_ATOM && actual_format == 32 && states) {
-        while (nitems) {
-            if (states[--nitems] == state) {
-                set = True;
-                break;
-            }
-        }
+    handler->count++;
+    handler->requests += xcb_no_operation(connection).sequence - measure->sequence - 1;
+    handler->replies += replies_waited - measure->replies;
+    handler->latency[get_latency_bucket(latency)]++;
+    if (latency > handler->max_latency) {
+        handler->max_latency = latency;
     }
+}
+
+unsigned int get_command_index(const char *name) {
+    unsigned int i;
+
+    for (i = 0; i < COMMAND_COUNT - 1 && strcmp(name, command_names[i]); i++);
+    return i;
+}
 
-    if (states) {
-        XFree(states);
+/* count, requests, replies and the 50th, 90th and 99th percentile and
+ * maximum latencies in microseconds of every handler that has run */
+void print_handler_stats(FILE *stream, const char *kind, const char *name, HandlerStats *handler) {
+    if (handler->count) {
+        fprintf(stream, "%s\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", kind, name,
+                handler->count, handler->requests, handler->replies,
+                get_percentile(handler, 50), get_percentile(handler, 90),
+                get_percentile(handler, 99), handler->max_latency);
     }
-    return set;
 }
 
+/* the start of a span, or 0 if not tracing, which costs only the test */
+long long trace_start() {
+    return tracing ? get_time_us() : 0;
+}
 
-void send_protocol(Window window, Atom protocol) {
-    Atom *protocols;
-    int count;
-    XEvent event;
-
-    if (XGetWMProtocols(display, window, &protocols, &count)) {
-        while (count) {
-            if (protocols[--count] == protocol) {
-                event.type = ClientMessage;
-                event.xclient.window = window;
-                event.xclient.message_type = wm_atoms[WM_PROTOCOLS];
-                event.xclient.format = 32;
-                event.xclient.data.l[0] = protocol;
-                event.xclient.data.l[1] = CurrentTime;
-                XSendEvent(display, window, False, NoEventMask, &event);
-                break;
-            }
-        }
-        XFree(protocols);
+/* record the span, the oldest making way once the ring is full */
+void trace_end(const char *category, const char *name, long long start) {
+    Span *span;
+
+    if (!start || !spans) {
+        return;
     }
+    if (spans_len == TRACE_SPANS) {
+        spans_start = (spans_start + 1) % TRACE_SPANS;
+        spans_len--;
+    }
+    span = &spans[(spans_start + spans_len++) % TRACE_SPANS];
+    span->category = category;
+    span->name = name;
+    span->start = start;
+    span->duration = get_time_us() - start;
 }
 
-void read_resources()
-{
-    Colormap map;
-    char *xrm;
-    XrmDatabase xrdb;
-    char *type[20];
-    XrmValue value;
-    XColor color;
-
-    map = DefaultColormap(display, screen);
-    XrmInitialize();
-    xrm = XResourceManagerString(display);
-    if (xrm != NULL) {
-        xrdb = XrmGetStringDatabase(xrm);
-        if (XrmGetResource(xrdb, "wmd.foreground", "*", type, &value)) {
-            XAllocNamedColor(display, map, value.addr, &color, &color);
-        } else {
-            XAllocNamedColor(display, map, "white", &color, &color);
-        }
-        foreground = color.pixel;
-        if (XrmGetResource(xrdb, "wmd.background", "*", type, &value)) {
-            XAllocNamedColor(display, map, value.addr, &color, &color);
-        } else {
-            XAllocNamedColor(display, map, "black", &color, &color);
-        }
-        background = color.pixel;
-        if (XrmGetResource(xrdb, "wmd.gapSize", "*", type, &value)) {
-            gap_size = atoi(value.addr);
-        } else {
-            gap_size = 0;
+/* trace on|off: start afresh or stop recording */
+void set_tracing(bool on) {
+    if (on) {
+        if (!spans) {
+            spans = malloc(TRACE_SPANS * sizeof(Span));
         }
-        if (XrmGetResource(xrdb, "wmd.borderSize", "*", type, &value)) {
-            border_size = atoi(value.addr);
-        } else {
-            border_size = 0;
-        }
-        if (XrmGetResource(xrdb, "wmd.topPadding", "*", type, &value)) {
-            top_padding = atoi(value.addr);
-        } else {
-            top_padding = 0;
-        }
-        XrmDestroyDatabase(xrdb);
+        spans_start = 0;
+        spans_len = 0;
     }
+    tracing = on;
 }
 
-Bool is_dock_window(Window window) {
-    return get_atom_property(window, net_atoms[_NET_WM_WINDOW_TYPE]) == net_atoms[_NET_WM_WINDOW_TYPE_DOCK];
+/* the recorded spans as complete events of the Chrome trace format, which
+ * Perfetto and chrome://tracing open */
+void print_trace(FILE *stream) {
+    Span *span;
+
+    fprintf(stream, "{\"traceEvents\":[");
+    for (unsigned int i = 0; i < spans_len; i++) {
+        span = &spans[(spans_start + i) % TRACE_SPANS];
+        fprintf(stream, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":1}",
+                i ? "," : "", span->name, span->category, span->start, span->duration,
+                (int) getpid());
+    }
+    fprintf(stream, "\n],\"displayTimeUnit\":\"ms\"}\n");
 }
 
-Bool is_manageable_window(Window window) {
-    XWindowAttributes attributes;
-    XWMHints *hints;
+void reset_stats() {
+    unsigned long ready_ms = stats.ready_ms;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.ready_ms = ready_ms;
+    memset(event_stats, 0, sizeof(event_stats));
+    memset(command_stats, 0, sizeof(command_stats));
+}
 
-    hints = NULL;
+/* fire once at expiry, in get_time() milliseconds, or never if 0 */
+void set_timer_fd(long long expiry) {
+    struct itimerspec spec;
 
-    Bool manageable = False;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = expiry / 1000;
+    spec.it_value.tv_nsec = expiry % 1000 * 1000000L;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    timer_armed = expiry;
+}
 
-    /* TODO ignore if no hints */
+long long get_next_expiry() {
+    long long expiry = 0;
+    Timer *timer;
 
-    if (window != None &&
-        window != root &&
-        XGetWindowAttributes(display, window, &attributes) &&
-        !attributes.override_redirect &&
-        /* ((hints = XGetWMHints(display, window)) && !hints->input) || */
-        !is_dock_window(window)) {
-        manageable = True;
+    for (int i = 0; i < TIMER_SLOTS; i++) {
+        for (timer = timer_wheel[i]; timer; timer = timer->next) {
+            if (!expiry || timer->expiry < expiry) {
+                expiry = timer->expiry;
+            }
+        }
     }
+    return expiry;
+}
 
-    if (hints) {
-        XFree(hints);
+void cancel_timer(Timer *timer) {
+    if (!timer->pending) {
+        return;
+    }
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        timer_wheel[(timer->expiry / TIMER_TICK) % TIMER_SLOTS] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
     }
+    timer->pending = false;
+    if (!--ntimers) {
+        set_timer_fd(0);
+    }
+}
 
-    return manageable;
+/* (re)arm timer to call back in delay milliseconds */
+void add_timer(Timer *timer, int delay) {
+    long long now;
+    Timer **slot;
+
+    cancel_timer(timer);
+    now = get_time();
+    if (!ntimers) {
+        timer_tick = now / TIMER_TICK;
+    }
+    timer->expiry = now + delay;
+    if (timer->expiry / TIMER_TICK <= timer_tick) {
+        timer->expiry = (timer_tick + 1) * TIMER_TICK;
+    }
+    slot = &timer_wheel[(timer->expiry / TIMER_TICK) % TIMER_SLOTS];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->pending = true;
+    ntimers++;
+    if (!timer_armed || timer->expiry < timer_armed) {
+        set_timer_fd(timer->expiry);
+    }
 }
 
-Bool is_managed_window(Window window) {
-    XWindowAttributes attributes;
+/* advance the wheel to the current tick and call back every expired timer */
+void run_timers() {
+    uint64_t expirations;
+    long long now_tick;
+    Timer *expired = NULL;
+    Timer *timer;
+    Timer *next;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        return;
+    }
+    timer_armed = 0;
+    now_tick = get_time() / TIMER_TICK;
+    for (int i = 0; i < TIMER_SLOTS && timer_tick < now_tick; i++) {
+        timer_tick++;
+        for (timer = timer_wheel[timer_tick % TIMER_SLOTS]; timer; timer = next) {
+            next = timer->next;
+            /* timers further out than one turn of the wheel stay put */
+            if (timer->expiry / TIMER_TICK <= now_tick) {
+                cancel_timer(timer);
+                timer->next = expired;
+                expired = timer;
+            }
+        }
+    }
+    timer_tick = now_tick;
 
-    return (is_manageable_window(window) &&
-            XGetWindowAttributes(display, window, &attributes) &&
-            (attributes.map_state == IsViewable ||
-             get_wm_state(window) == IconicState));
+    for (timer = expired; timer; timer = next) {
+        next = timer->next;
+        timer->next = NULL;
+        timer->callback(timer);
+    }
+    /* the callbacks may have added timers, so look again for the earliest */
+    set_timer_fd(ntimers ? get_next_expiry() : 0);
 }
 
-Bool is_above_window(Window window) {
-    return is_managed_window(window) && is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_ABOVE]);
+xcb_window_t read_active_window() {
+    xcb_get_property_reply_t *reply;
+    xcb_window_t window;
+
+    window = XCB_WINDOW_NONE;
+    reply = get_property_reply(request_property(root, net_atoms[_NET_ACTIVE_WINDOW],
+                                                XCB_ATOM_WINDOW, 1),
+                               32);
+    if (reply) {
+        window = *(xcb_window_t *) xcb_get_property_value(reply);
+        free(reply);
+    }
+
+    return window;
 }
 
-Bool is_not_above_window(Window window) {
-    return is_managed_window(window) && !is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_ABOVE]);
+xcb_window_t get_active_window() {
+    return active_window;
 }
 
-Bool is_normal_window(Window window) {
-    return is_not_above_window(window) && get_wm_state(window) == NormalState;
+xcb_window_t get_pointer_reply(xcb_query_pointer_cookie_t cookie) {
+    xcb_query_pointer_reply_t *reply;
+    xcb_window_t child = XCB_WINDOW_NONE;
+    long long start = trace_start();
+
+    replies_waited++;
+    if ((reply = xcb_query_pointer_reply(connection, cookie, NULL))) {
+        child = reply->child;
+        free(reply);
+    }
+    trace_end("x", "QueryPointer", start);
+    return child;
 }
 
-unsigned int get_windows(Bool (*predicate)(Window), Window **windows) {
-    Window parent;
-    Window *children;
-    unsigned int nchildren;
-    Window window;
-    unsigned int nwindows;
-    int start;
-    int end;
+xcb_get_property_cookie_t request_wm_state(xcb_window_t window) {
+    return request_property(window, wm_atoms[WM_STATE], wm_atoms[WM_STATE], 2);
+}
 
-    XQueryTree(display, root, &root, &parent, &children, &nchildren);
+long get_wm_state_reply(xcb_get_property_cookie_t cookie) {
+    xcb_get_property_reply_t *reply;
+    long state = -1;
 
-    nwindows = 0;
-    for (unsigned int i = 0; i < nchildren; i++) {
-        window = children[i];
-        if (predicate(window)) {
-            children[nwindows++] = window;
-        }
+    if ((reply = get_property_reply(cookie, 32))) {
+        state = *(uint32_t *) xcb_get_property_value(reply);
+        free(reply);
     }
+    return state;
+}
+
+xcb_get_property_cookie_t request_net_wm_state(xcb_window_t window) {
+    return request_property(window, net_atoms[_NET_WM_STATE], XCB_ATOM_ATOM, UINT32_MAX / 4);
+}
+
+xcb_get_property_cookie_t request_protocols(xcb_window_t window) {
+    return request_property(window, wm_atoms[WM_PROTOCOLS], XCB_ATOM_ATOM, UINT32_MAX / 4);
+}
+
+xcb_atom_t *get_atoms_reply(xcb_get_property_cookie_t cookie, int *natoms) {
+    xcb_get_property_reply_t *reply;
+    xcb_atom_t *atoms = NULL;
 
-    start = 0;
-    end = nwindows - 1;
-    while (start < end) {
-        window = children[start];
-        children[start++] = children[end];
-        children[end--] = window;
+    *natoms = 0;
+    if ((reply = get_property_reply(cookie, 32))) {
+        *natoms = reply->value_len;
+        atoms = malloc(*natoms * sizeof(xcb_atom_t));
+        memcpy(atoms, xcb_get_property_value(reply), *natoms * sizeof(xcb_atom_t));
+        free(reply);
     }
+    return atoms;
+}
 
-    if (nwindows == 0) {
-        if (children) {
-            XFree(children);
-        }
-    } else {
-        *windows = children;
+uint32_t hash_bytes(uint32_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619;
     }
-    return nwindows;
+    return hash;
+}
+
+uint32_t hash_string(uint32_t hash, const char *string) {
+    return hash_bytes(hash, string ? string : "", string ? strlen(string) + 1 : 1);
 }
 
-Window get_first_window(Bool (*predicate)(Window)) {
-    Window parent;
-    Window *children = NULL;
-    unsigned int nchildren;
-    Window window = None;
+static unsigned int client_bucket(xcb_window_t window) {
+    return (window ^ (window >> 16)) % CLIENT_BUCKETS;
+}
 
-    XQueryTree(display, root, &root, &parent, &children, &nchildren);
+Client *get_client(xcb_window_t window) {
+    Client *client;
 
-    while(nchildren) {
-        window = children[--nchildren];
-        if (predicate(window)) {
+    for (client = clients[client_bucket(window)]; client; client = client->next) {
+        if (client->window == window) {
             break;
-        } else {
-            window = None;
         }
     }
+    return client;
+}
 
-    if (children) {
-        XFree(children);
-    }
+Client **get_index_link(Client **index, Client *client) {
+    return (index == instance_index ? &client->instance_next :
+            index == class_index ? &client->class_next : &client->pid_next);
+}
 
-    return window;
+unsigned int string_bucket(const char *string) {
+    return hash_string(2166136261, string) % CLIENT_BUCKETS;
 }
 
-unsigned int get_managed_windows(Window **windows) {
-    return get_windows(&is_managed_window, windows);
+void link_index(Client **index, unsigned int bucket, Client *client) {
+    *get_index_link(index, client) = index[bucket];
+    index[bucket] = client;
 }
 
-void print_window(FILE *stream, char *prefix, Window window, char *global_flags) {
-    XWindowAttributes attributes = { 0, 0, 0, 0 };
-    XClassHint class = { NULL, NULL };
-    char *class_name = "";
-    char *class_class = "";
-    XTextProperty name;
-    char *name_name = "";
-    name.value = NULL;
-    char flags[FLAG_COUNT];
-    flags[0] = '\0';
-    unsigned char *pid = NULL;
+void unlink_index(Client **index, unsigned int bucket, Client *client) {
+    Client **link;
 
-    if (global_flags) {
-        strcat(flags, global_flags);
+    for (link = &index[bucket]; *link; link = get_index_link(index, *link)) {
+        if (*link == client) {
+            *link = *get_index_link(index, client);
+            break;
+        }
     }
+}
 
-    if (window == root) {
-        strcat(flags, FLAG_ROOT);
-        attributes.width = screen_width;
-        attributes.height = screen_height;
-    } else if (window != None) {
-        XGetWindowAttributes(display, window, &attributes);
-        if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
-            strcat(flags, FLAG_FULLSCREEN);
-        }
-        if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_ABOVE])) {
-            strcat(flags, FLAG_ABOVE);
-        }
-        if (get_wm_state(window) == IconicState) {
-            strcat(flags, FLAG_ICONIC);
-        }
-        pid = get_property(window, net_atoms[_NET_WM_PID], 1, XA_CARDINAL);
+void index_client(Client *client) {
+    link_index(instance_index, string_bucket(client->instance), client);
+    link_index(class_index, string_bucket(client->class), client);
+    link_index(pid_index, client->pid % CLIENT_BUCKETS, client);
+    client->indexed = true;
+}
 
-        XGetClassHint(display, window, &class);
-        if (class.res_name) {
-            class_name = class.res_name;
-        }
-        if (class.res_class) {
-            class_class = class.res_class;
-        }
-        if ((XGetTextProperty(display, window, &name, net_atoms[_NET_WM_NAME]) ||
-             XGetWMName(display, window, &name)) &&
-            name.value) {
-            name_name = (char *)name.value;
-        }
+void unindex_client(Client *client) {
+    if (client->indexed) {
+        unlink_index(instance_index, string_bucket(client->instance), client);
+        unlink_index(class_index, string_bucket(client->class), client);
+        unlink_index(pid_index, client->pid % CLIENT_BUCKETS, client);
+        client->indexed = false;
     }
-    if (stream) {
-        fprintf(stream,
-                "%s0x%07lx\t%s\t%d\t%d\t%d\t%d\t%d\t%s\t%s\t%s\n",
-                prefix ? prefix : "",
-                window,
-                *flags ? flags : " ",
-                attributes.width,
-                attributes.height,
-                attributes.x,
-                attributes.y,
-                pid ? *(int *) pid : 0,
-                class_name,
-                class_class,
-                name_name);
-        fflush(stream);
+}
+
+void unstack_client(Client *client) {
+    if (client->above) {
+        client->above->below = client->below;
+    } else if (top_client == client) {
+        top_client = client->below;
     }
-    if (pid) {
-        XFree(pid);
+    if (client->below) {
+        client->below->above = client->above;
+    } else if (bottom_client == client) {
+        bottom_client = client->above;
     }
-    if (class.res_name) {
-        XFree(class.res_name);
+    client->above = NULL;
+    client->below = NULL;
+}
+
+/* place client directly above sibling, or at the bottom if sibling is NULL */
+void stack_client(Client *client, Client *sibling) {
+    if (client == sibling) {
+        return;
     }
-    if (class.res_class) {
-        XFree(class.res_class);
+    unstack_client(client);
+    client->below = sibling;
+    client->above = sibling ? sibling->above : bottom_client;
+    if (client->above) {
+        client->above->below = client;
+    } else {
+        top_client = client;
     }
-    if (name.value) {
-        XFree(name.value);
+    if (client->below) {
+        client->below->above = client;
+    } else {
+        bottom_client = client;
     }
 }
 
-void tile_window(Window window,
-                 int grid_width,
-                 int grid_height,
-                 int width,
-                 int height,
-                 int x,
-                 int y) {
-    int tile_width;
-    int tile_height;
-    XSizeHints hints;
-    long supplied;
-    XWindowAttributes attributes;
-    Atom type;
-    int border_size;
-    int window_x;
-    int window_y;
-    int window_width;
-    int window_height;
+Client *add_client(xcb_window_t window, bool override_redirect) {
+    Client *client;
+    unsigned int bucket;
 
-    tile_width = (screen_width - gap_size) / grid_width;
-    tile_height = (screen_height - top_padding - gap_size) / grid_height;
+    if ((client = get_client(window))) {
+        return client;
+    }
 
-    XGetWindowAttributes(display, window, &attributes);
+    client = calloc(1, sizeof(Client));
+    client->window = window;
+    client->override_redirect = override_redirect;
+    client->map_state = XCB_MAP_STATE_UNMAPPED;
+    client->wm_state = -1;
+    client->type = XCB_ATOM_NONE;
 
-    hints.flags = 0;
-    XGetWMNormalHints(display, window, &hints, &supplied);
+    bucket = client_bucket(window);
+    client->next = clients[bucket];
+    clients[bucket] = client;
+    stack_client(client, top_client);
 
-    type = get_atom_property(window, net_atoms[_NET_WM_WINDOW_TYPE]);
+    return client;
+}
 
-    border_size = get_border_size(window);
+/* note a window leaving the windows output in the coming generation */
+void add_removal(xcb_window_t window) {
+    if (nremovals == REMOVALS_MAX) {
+        removals_floor = removals[REMOVALS_MAX / 2 - 1].generation;
+        nremovals -= REMOVALS_MAX / 2;
+        memmove(removals, removals + REMOVALS_MAX / 2, nremovals * sizeof(*removals));
+    }
+    removals[nremovals].window = window;
+    removals[nremovals].generation = generation + 1;
+    nremovals++;
+}
 
-    window_x = gap_size + tile_width * x;
-    window_y = top_padding + gap_size + tile_height * y;
-    window_width = tile_width * width - gap_size - border_size * 2;
-    window_height = tile_height * height - gap_size - border_size * 2;
+void remove_client(xcb_window_t window) {
+    Client **link;
+    Client *client;
 
-    if (hints.flags & PPosition && hints.flags & PSize) {
-        window_x = hints.x;
-        window_y = hints.y;
-        window_width = hints.width;
-        window_height = hints.height;
-    } else if (type == net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] ||
-               type == net_atoms[_NET_WM_WINDOW_TYPE_SPLASH]) {
-        if (attributes.width < window_width) {
-            window_x += (window_width - attributes.width) / 2;
-            window_width = attributes.width;
-        }
-        if (attributes.height < window_height) {
-            window_y += (window_height - attributes.height) / 2;
-            window_height = attributes.height;
-        }
-    } else if (hints.flags & PMaxSize &&
-               (hints.max_width < window_width ||
-                hints.max_height < window_height)) {
-        if (hints.max_width < window_width) {
-            window_x += (window_width - hints.max_width) / 2;
-            window_width = hints.max_width;
+    for (link = &clients[client_bucket(window)]; *link; link = &(*link)->next) {
+        if ((*link)->window == window) {
+            client = *link;
+            *link = client->next;
+            if (client->listed) {
+                add_removal(window);
+            }
+            unstack_client(client);
+            unindex_client(client);
+            free(client->states);
+            free(client->protocols);
+            free(client->instance);
+            free(client->class);
+            free(client->name);
+            free(client);
+            break;
         }
-        if (hints.max_height < window_height) {
-            window_y += (window_height - hints.max_height) / 2;
-            window_height = hints.max_height;
+    }
+}
+
+void update_wm_state(Client *client) {
+    client->wm_state = get_wm_state_reply(request_wm_state(client->window));
+}
+
+void update_layer(Client *client) {
+    client->layer = LAYER_NORMAL;
+    for (int i = 0; i < client->nstates; i++) {
+        if (client->states[i] == net_atoms[_NET_WM_STATE_ABOVE]) {
+            client->layer = LAYER_ABOVE;
         }
-    } else if (hints.flags & PAspect) {
     }
+}
 
-    if (hints.flags & PResizeInc) {
-        if (hints.width_inc) {
-            window_width -= window_width % hints.width_inc;
+void update_net_wm_state(Client *client) {
+    free(client->states);
+    client->states = get_atoms_reply(request_net_wm_state(client->window),
+                                            &client->nstates);
+    update_layer(client);
+}
+
+void set_window_type(Client *client, xcb_atom_t type) {
+    client->type = type;
+    client->manageable = (!client->override_redirect &&
+                          client->type != net_atoms[_NET_WM_WINDOW_TYPE_DOCK]);
+}
+
+void update_window_type(Client *client) {
+    set_window_type(client, get_atom_property(client->window, net_atoms[_NET_WM_WINDOW_TYPE]));
+}
+
+/* everything the predicates need of a window, in flight */
+typedef struct {
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_geometry_cookie_t geometry;
+    xcb_get_property_cookie_t wm_state;
+    xcb_get_property_cookie_t net_wm_state;
+    xcb_get_property_cookie_t type;
+} ClientInfo;
+
+void request_client_info(xcb_window_t window, ClientInfo *info) {
+    info->attributes = xcb_get_window_attributes(connection, window);
+    info->geometry = xcb_get_geometry(connection, window);
+    info->wm_state = request_wm_state(window);
+    info->net_wm_state = request_net_wm_state(window);
+    info->type = request_property(window, net_atoms[_NET_WM_WINDOW_TYPE], XCB_ATOM_ATOM, 1);
+}
+
+void get_client_info_reply(ClientInfo *info, Client *client) {
+    xcb_get_window_attributes_reply_t *attributes;
+    xcb_get_geometry_reply_t *geometry;
+    long long start = trace_start();
+
+    replies_waited += 2;
+    attributes = xcb_get_window_attributes_reply(connection, info->attributes, NULL);
+    geometry = xcb_get_geometry_reply(connection, info->geometry, NULL);
+    trace_end("x", "GetWindowAttributes", start);
+    client->wm_state = get_wm_state_reply(info->wm_state);
+    free(client->states);
+    client->states = get_atoms_reply(info->net_wm_state, &client->nstates);
+    update_layer(client);
+    if (attributes) {
+        client->override_redirect = attributes->override_redirect;
+        client->map_state = attributes->map_state;
+    }
+    if (geometry) {
+        client->border_width = geometry->border_width;
+        client->x = geometry->x;
+        client->y = geometry->y;
+        client->width = geometry->width;
+        client->height = geometry->height;
+    }
+    client->stale = true;
+    clients_stale = true;
+    set_window_type(client, get_atom_reply(info->type));
+    if (!attributes) {
+        client->manageable = false;
+    }
+
+    free(attributes);
+    free(geometry);
+}
+
+/* query everything the predicates need; called on MapRequest */
+void fill_client(Client *client) {
+    ClientInfo info;
+
+    request_client_info(client->window, &info);
+    get_client_info_reply(&info, client);
+}
+
+/* Take in every child of root, as at startup or after a restart. The
+ * queries for all of the children are sent before any reply is waited on,
+ * so adoption costs a couple of round trips however many windows there are. */
+void adopt_windows() {
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    int nchildren;
+    ClientInfo *infos;
+    long long start = trace_start();
+
+    replies_waited++;
+    tree = xcb_query_tree_reply(connection, xcb_query_tree(connection, root), NULL);
+    trace_end("x", "QueryTree", start);
+    if (!tree) {
+        return;
+    }
+    children = xcb_query_tree_children(tree);
+    nchildren = xcb_query_tree_children_length(tree);
+    infos = malloc(nchildren * sizeof(ClientInfo));
+    for (int i = 0; i < nchildren; i++) {
+        request_client_info(children[i], &infos[i]);
+    }
+    /* bottom to top, each stacked over the last */
+    for (int i = 0; i < nchildren; i++) {
+        get_client_info_reply(&infos[i], add_client(children[i], false));
+    }
+    free(infos);
+    free(tree);
+}
+
+/* Move, resize and set the border of the window in one request, unless it
+ * has that geometry already. The client takes the geometry at once, so
+ * another change before the ConfigureNotify compares against it. */
+void set_geometry(xcb_window_t window, int x, int y, int width, int height, int border_width) {
+    uint32_t values[] = { x, y, width, height, border_width };
+    Client *client;
+
+    if ((client = get_client(window))) {
+        if (client->x == x && client->y == y &&
+            client->width == width && client->height == height &&
+            client->border_width == border_width) {
+            stats.writes_saved++;
+            return;
+        }
+        client->x = x;
+        client->y = y;
+        client->width = width;
+        client->height = height;
+        client->border_width = border_width;
+    }
+    configure(window,
+              XCB_CONFIG_WINDOW_X|XCB_CONFIG_WINDOW_Y|XCB_CONFIG_WINDOW_WIDTH|
+              XCB_CONFIG_WINDOW_HEIGHT|XCB_CONFIG_WINDOW_BORDER_WIDTH,
+              values);
+}
+
+void set_wm_state(xcb_window_t window, long state) {
+    uint32_t data[] = { state, XCB_WINDOW_NONE };
+    Client *client;
+
+    if ((client = get_client(window)) && client->wm_state == state) {
+        stats.writes_saved++;
+        return;
+    }
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, wm_atoms[WM_STATE],
+                        wm_atoms[WM_STATE], 32, 2, data);
+    if ((client = get_client(window))) {
+        client->wm_state = state;
+        client->wm_state_writes++;
+    }
+}
+
+long get_wm_state(xcb_window_t window) {
+    Client *client = get_client(window);
+
+    return client ? client->wm_state : -1;
+}
+
+void set_net_wm_state(xcb_window_t window, xcb_atom_t state, bool set) {
+    Client *client;
+    xcb_atom_t *states;
+    int nstates = 0;
+    int i;
+
+    if (!(client = get_client(window))) {
+        return;
+    }
+
+    for (i = 0; i < client->nstates; i++) {
+        if (client->states[i] == state) {
+            break;
+        }
+    }
+    if (set == (i < client->nstates)) {
+        stats.writes_saved++;
+        return;
+    }
+
+    states = malloc((client->nstates + 1) * sizeof(xcb_atom_t));
+    for (i = 0; i < client->nstates; i++) {
+        if (client->states[i] != state) {
+            states[nstates++] = client->states[i];
+        }
+    }
+    if (set) {
+        states[nstates++] = state;
+    }
+    if (nstates) {
+        xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, net_atoms[_NET_WM_STATE],
+                            XCB_ATOM_ATOM, 32, nstates, states);
+    } else {
+        xcb_delete_property(connection, window, net_atoms[_NET_WM_STATE]);
+    }
+    client->net_wm_state_writes++;
+
+    free(client->states);
+    client->states = states;
+    client->nstates = nstates;
+    update_layer(client);
+}
+
+bool is_net_wm_state_set(xcb_window_t window, xcb_atom_t state) {
+    Client *client = get_client(window);
+
+    if (client) {
+        for (int i = 0; i < client->nstates; i++) {
+            if (client->states[i] == state) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+/* send the protocol message if the window takes part in the protocol */
+void send_protocol(xcb_window_t window, xcb_atom_t protocol) {
+    Client *client;
+    xcb_atom_t *protocols;
+    int count;
+    bool supported = false;
+    xcb_client_message_event_t event;
+    long long start = trace_start();
+
+    if ((client = get_client(window))) {
+        if (!client->protocols_cached) {
+            client->protocols = get_atoms_reply(request_protocols(window), &client->nprotocols);
+            client->protocols_cached = true;
+        }
+        protocols = client->protocols;
+        count = client->nprotocols;
+    } else {
+        protocols = get_atoms_reply(request_protocols(window), &count);
+    }
+    while (count && !supported) {
+        supported = protocols[--count] == protocol;
+    }
+    if (!client) {
+        free(protocols);
+    }
+
+    if (supported) {
+        memset(&event, 0, sizeof(event));
+        event.response_type = XCB_CLIENT_MESSAGE;
+        event.window = window;
+        event.type = wm_atoms[WM_PROTOCOLS];
+        event.format = 32;
+        event.data.data32[0] = protocol;
+        event.data.data32[1] = XCB_CURRENT_TIME;
+        xcb_send_event(connection, 0, window, XCB_EVENT_MASK_NO_EVENT, (char *) &event);
+    }
+    trace_end("wm", "send_protocol", start);
+}
+
+/* match a resource specifier such as "wmd.foreground", "wmd*foreground" or
+ * "*foreground" against the components of a name; returns how specific the
+ * match is, or -1 if it does not match */
+int match_resource(const char *specifier, int length, const char **names, int nnames) {
+    bool loose = false;
+    int component;
+    int best;
+    int score;
+
+    while (length && (*specifier == '.' || *specifier == '*')) {
+        loose |= *specifier == '*';
+        specifier++;
+        length--;
+    }
+    if (!length) {
+        return nnames ? -1 : 0;
+    }
+    for (component = 0;
+         component < length && specifier[component] != '.' && specifier[component] != '*';
+         component++);
+
+    best = -1;
+    for (int i = 0; i < nnames; i++) {
+        if (component == 1 && *specifier == '?') {
+            score = 1;
+        } else if ((int) strlen(names[i]) == component &&
+                   !strncmp(specifier, names[i], component)) {
+            score = 2;
+        } else {
+            score = -1;
+        }
+        if (score >= 0 &&
+            (score = match_resource(specifier + component, length - component,
+                                    names + i + 1, nnames - i - 1)) >= 0) {
+            score += component == 1 && *specifier == '?' ? 1 : 2;
+            if (score > best) {
+                best = score;
+            }
+        }
+        if (!loose) {
+            break;
+        }
+    }
+    return best;
+}
+
+/* the value of the most specific entry for name in an xrdb database string,
+ * later entries winning ties like they do in xrdb */
+char *get_resource(const char *database, const char *name) {
+    const char *names[8];
+    char buffer[64];
+    int nnames = 0;
+    const char *line;
+    const char *key_end;
+    const char *colon;
+    const char *end;
+    const char *value = NULL;
+    int value_length = 0;
+    int best = -1;
+    int score;
+    char *result;
+
+    snprintf(buffer, sizeof(buffer), "%s", name);
+    for (char *token = strtok(buffer, "."); token && nnames < 8; token = strtok(NULL, ".")) {
+        names[nnames++] = token;
+    }
+
+    for (line = database; *line; line = *end ? end + 1 : end) {
+        if (!(end = strchr(line, '\n'))) {
+            end = line + strlen(line);
+        }
+        while (line < end && (*line == ' ' || *line == '\t')) {
+            line++;
+        }
+        if (*line == '!' || !(colon = memchr(line, ':', end - line))) {
+            continue;
+        }
+        key_end = colon;
+        while (key_end > line && (key_end[-1] == ' ' || key_end[-1] == '\t')) {
+            key_end--;
+        }
+        if ((score = match_resource(line, key_end - line, names, nnames)) >= 0 &&
+            score >= best) {
+            best = score;
+            value = colon + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            value_length = end - value;
+        }
+    }
+
+    if (!value) {
+        return NULL;
+    }
+    result = malloc(value_length + 1);
+    memcpy(result, value, value_length);
+    result[value_length] = '\0';
+    return result;
+}
+
+/* the server only knows color names, so #rrggbb is parsed here */
+uint32_t alloc_color(const char *name, const char *fallback) {
+    xcb_alloc_color_reply_t *color;
+    xcb_alloc_named_color_reply_t *named_color;
+    unsigned int red;
+    unsigned int green;
+    unsigned int blue;
+    uint32_t pixel = 0;
+    long long start = trace_start();
+
+    if (!name) {
+        name = fallback;
+    }
+    replies_waited++;
+    if (*name == '#' && strlen(name) == 7 &&
+        sscanf(name + 1, "%2x%2x%2x", &red, &green, &blue) == 3) {
+        color = xcb_alloc_color_reply(connection,
+                                      xcb_alloc_color(connection, screen->default_colormap,
+                                                      red * 0x101, green * 0x101, blue * 0x101),
+                                      NULL);
+        trace_end("x", "AllocColor", start);
+        if (color) {
+            pixel = color->pixel;
+            free(color);
+        }
+    } else {
+        named_color = xcb_alloc_named_color_reply(connection,
+                                                  xcb_alloc_named_color(connection,
+                                                                        screen->default_colormap,
+                                                                        strlen(name), name),
+                                                  NULL);
+        trace_end("x", "AllocNamedColor", start);
+        if (named_color) {
+            pixel = named_color->pixel;
+            free(named_color);
+        }
+    }
+    return pixel;
+}
+
+int get_int_resource(const char *database, const char *name) {
+    char *value;
+    int number = 0;
+
+    if ((value = get_resource(database, name))) {
+        number = atoi(value);
+        free(value);
+    }
+    return number;
+}
+
+/* switch to the named automatic layout, or to none */
+bool set_auto_layout(const char *name) {
+    int layout;
+
+    for (layout = 0; layout < LAYOUT_COUNT && (!name || strcmp(name, layout_names[layout])); layout++);
+    if (layout == LAYOUT_COUNT) {
+        layout = LAYOUT_NONE;
+    }
+    if (layout != auto_layout) {
+        auto_layout = layout;
+        reset_layout();
+    }
+    return !name || layout != LAYOUT_NONE || !strcmp(name, layout_names[LAYOUT_NONE]);
+}
+
+void read_resources()
+{
+    char *xrm;
+    char *value;
+
+    xrm = get_string_reply(request_property(root, XCB_ATOM_RESOURCE_MANAGER, XCB_ATOM_STRING,
+                                            UINT32_MAX / 4),
+                           NULL);
+    if (xrm != NULL) {
+        value = get_resource(xrm, "wmd.foreground");
+        foreground = alloc_color(value, "white");
+        free(value);
+        value = get_resource(xrm, "wmd.background");
+        background = alloc_color(value, "black");
+        free(value);
+        gap_size = get_int_resource(xrm, "wmd.gapSize");
+        border_size = get_int_resource(xrm, "wmd.borderSize");
+        top_padding = get_int_resource(xrm, "wmd.topPadding");
+        /* a layout picked with the autolayout command stays until the
+         * resource itself changes */
+        value = get_resource(xrm, "wmd.layout");
+        if (value && (!layout_resource || strcmp(value, layout_resource))) {
+            set_auto_layout(value);
+        }
+        free(layout_resource);
+        layout_resource = value;
+        free(xrm);
+    }
+}
+
+bool is_manageable_window(xcb_window_t window) {
+    Client *client = get_client(window);
+
+    return window != root && client && client->manageable;
+}
+
+bool is_managed_window(xcb_window_t window) {
+    Client *client = get_client(window);
+
+    return (window != root &&
+            client &&
+            client->manageable &&
+            (client->map_state == XCB_MAP_STATE_VIEWABLE ||
+             client->wm_state == IconicState));
+}
+
+bool is_not_above_window(xcb_window_t window) {
+    return is_managed_window(window) && get_client(window)->layer == LAYER_NORMAL;
+}
+
+bool is_normal_window(xcb_window_t window) {
+    return is_not_above_window(window) && get_wm_state(window) == NormalState;
+}
+
+/* Re-read the resources after RESOURCE_MANAGER changed and redo only what
+ * the changed values affect: the border colours, or the geometry of every
+ * tiled window, all sent in the one batch. */
+void reload_resources() {
+    unsigned int old_foreground = foreground;
+    unsigned int old_background = background;
+    int old_gap_size = gap_size;
+    int old_border_size = border_size;
+    int old_top_padding = top_padding;
+    xcb_window_t active = get_active_window();
+    Client *client;
+
+    read_resources();
+    for (client = top_client; client; client = client->below) {
+        if (!is_managed_window(client->window)) {
+            continue;
+        }
+        if (client->window == active && foreground != old_foreground) {
+            set_border_color(client->window, foreground);
+        } else if (client->window != active && background != old_background) {
+            set_border_color(client->window, background);
+        }
+    }
+    if (gap_size != old_gap_size ||
+        border_size != old_border_size ||
+        top_padding != old_top_padding) {
+        retile_windows();
+    }
+}
+
+/* matching windows, topmost first */
+unsigned int get_windows(bool (*predicate)(xcb_window_t), xcb_window_t **windows) {
+    Client *client;
+    unsigned int nwindows;
+
+    nwindows = 0;
+    for (client = top_client; client; client = client->below) {
+        if (predicate(client->window)) {
+            nwindows++;
+        }
+    }
+
+    if (nwindows) {
+        *windows = malloc(nwindows * sizeof(xcb_window_t));
+        nwindows = 0;
+        for (client = top_client; client; client = client->below) {
+            if (predicate(client->window)) {
+                (*windows)[nwindows++] = client->window;
+            }
+        }
+    }
+    return nwindows;
+}
+
+/* The lowest managed window in a layer higher than the given one, which
+ * the top of that layer lies right below, or NULL if the layer is topmost.
+ * The stacking isn't kept sorted by layer, a fullscreen window being raised
+ * over everything, so this walks up from the bottom, through every window
+ * below the lowest higher one. */
+Client *get_layer_ceiling(int layer) {
+    Client *client;
+
+    for (client = bottom_client; client; client = client->above) {
+        if (client->layer > layer && is_managed_window(client->window)) {
+            return client;
+        }
+    }
+    return NULL;
+}
+
+xcb_window_t get_first_window(bool (*predicate)(xcb_window_t)) {
+    Client *client;
+
+    for (client = top_client; client; client = client->below) {
+        if (predicate(client->window)) {
+            return client->window;
+        }
+    }
+    return XCB_WINDOW_NONE;
+}
+
+unsigned int get_managed_windows(xcb_window_t **windows) {
+    return get_windows(&is_managed_window, windows);
+}
+
+/* the properties behind one line of window output, in flight */
+typedef struct {
+    xcb_get_property_cookie_t pid;
+    xcb_get_property_cookie_t class;
+    xcb_get_property_cookie_t net_name;
+    xcb_get_property_cookie_t name;
+} WindowInfo;
+
+void request_window_info(WindowInfo *info, xcb_window_t window) {
+    info->pid = request_property(window, net_atoms[_NET_WM_PID], XCB_ATOM_CARDINAL, 1);
+    info->class = request_property(window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 1024);
+    info->net_name = request_property(window, net_atoms[_NET_WM_NAME],
+                                      XCB_GET_PROPERTY_TYPE_ANY, 1024);
+    info->name = request_property(window, XCB_ATOM_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, 1024);
+}
+
+void get_window_info_reply(WindowInfo *info, Client *client) {
+    xcb_get_property_reply_t *pid;
+    char *class;
+    int class_length;
+
+    unindex_client(client);
+    free(client->instance);
+    free(client->class);
+    free(client->name);
+
+    pid = get_property_reply(info->pid, 32);
+    client->pid = pid ? *(int *) xcb_get_property_value(pid) : 0;
+    free(pid);
+
+    /* WM_CLASS holds the instance and class names, each NUL terminated */
+    client->instance = NULL;
+    client->class = NULL;
+    if ((class = get_string_reply(info->class, &class_length))) {
+        client->instance = strdup(class);
+        if ((int) strlen(class) < class_length) {
+            client->class = strdup(class + strlen(class) + 1);
+        }
+        free(class);
+    }
+    if ((client->name = get_string_reply(info->net_name, NULL))) {
+        xcb_discard_reply(connection, info->name.sequence);
+    } else {
+        client->name = get_string_reply(info->name, NULL);
+    }
+    index_client(client);
+    client->stale = false;
+}
+
+/* refetch the properties of every stale client in one round trip */
+void refresh_clients() {
+    Client *client;
+    WindowInfo *infos;
+    int nclients = 0;
+    int i;
+
+    if (!clients_stale) {
+        return;
+    }
+    for (client = top_client; client; client = client->below) {
+        nclients += client->stale;
+    }
+    infos = malloc(nclients * sizeof(WindowInfo));
+    for (i = 0, client = top_client; client; client = client->below) {
+        if (client->stale) {
+            request_window_info(&infos[i++], client->window);
+        }
+    }
+    for (i = 0, client = top_client; client; client = client->below) {
+        if (client->stale) {
+            get_window_info_reply(&infos[i++], client);
+        }
+    }
+    free(infos);
+    clients_stale = false;
+}
+
+void print_window(FILE *stream, char *prefix, xcb_window_t window, char *global_flags) {
+    Client *client = NULL;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    char flags[FLAG_COUNT];
+    flags[0] = '\0';
+
+    if (!stream) {
+        return;
+    }
+
+    if (global_flags) {
+        strcat(flags, global_flags);
+    }
+
+    if (window == root) {
+        strcat(flags, FLAG_ROOT);
+        width = screen_width;
+        height = screen_height;
+    } else if ((client = get_client(window))) {
+        if (client->stale) {
+            refresh_clients();
+        }
+        x = client->x;
+        y = client->y;
+        width = client->width;
+        height = client->height;
+        if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
+            strcat(flags, FLAG_FULLSCREEN);
+        }
+        if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_ABOVE])) {
+            strcat(flags, FLAG_ABOVE);
+        }
+        if (get_wm_state(window) == IconicState) {
+            strcat(flags, FLAG_ICONIC);
+        }
+    }
+    fprintf(stream,
+            "%s0x%07x\t%s\t%d\t%d\t%d\t%d\t%d\t%s\t%s\t%s\n",
+            prefix ? prefix : "",
+            window,
+            *flags ? flags : " ",
+            width,
+            height,
+            x,
+            y,
+            client ? client->pid : 0,
+            client && client->instance ? client->instance : "",
+            client && client->class ? client->class : "",
+            client && client->name ? client->name : "");
+    fflush(stream);
+}
+
+/* the flags of the window's line */
+void get_client_flags(Client *client, xcb_window_t pointer, char *flags) {
+    flags[0] = '\0';
+    if (client->window == get_active_window()) {
+        strcat(flags, FLAG_ACTIVE);
+    }
+    if (client->window == pointer) {
+        strcat(flags, FLAG_POINTER);
+    }
+    if (is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
+        strcat(flags, FLAG_FULLSCREEN);
+    }
+    if (is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_ABOVE])) {
+        strcat(flags, FLAG_ABOVE);
+    }
+    if (client->wm_state == IconicState) {
+        strcat(flags, FLAG_ICONIC);
+    }
+}
+
+void add_selector_flags(Selector *selector, const char *flags) {
+    for (; *flags; flags++) {
+        if (!strchr(selector->flags, *flags)) {
+            strncat(selector->flags, flags, 1);
+        }
+    }
+}
+
+/* Add the comma separated conditions of spec to selector:
+ * window=<window>, instance=, class= or name=<pattern>, pid=<pid>,
+ * flag=<flags>, and active, under-pointer, fullscreen, above, iconic and
+ * mapped. Patterns are shell patterns; literal instance and class names
+ * and pids are looked up in the indices. */
+bool parse_selector(Selector *selector, const char *spec) {
+    char *terms = strdup(spec);
+    char *term;
+    char *end;
+    bool valid = true;
+
+    for (term = strtok(terms, ","); term && valid; term = strtok(NULL, ",")) {
+        if (!strncmp(term, "window=", 7)) {
+            valid = (sscanf(term + 7, "0x%x", &selector->window) ||
+                     sscanf(term + 7, "%u", &selector->window));
+        } else if (!strncmp(term, "instance=", 9)) {
+            free(selector->instance);
+            selector->instance = strdup(term + 9);
+        } else if (!strncmp(term, "class=", 6)) {
+            free(selector->class);
+            selector->class = strdup(term + 6);
+        } else if (!strncmp(term, "name=", 5)) {
+            free(selector->name);
+            selector->name = strdup(term + 5);
+        } else if (!strncmp(term, "pid=", 4)) {
+            selector->pid = strtol(term + 4, &end, 10);
+            valid = !*end && selector->pid > 0;
+        } else if (!strncmp(term, "flag=", 5)) {
+            valid = strspn(term + 5, FLAG_ACTIVE FLAG_POINTER FLAG_FULLSCREEN
+                           FLAG_ABOVE FLAG_ICONIC) == strlen(term + 5);
+            if (valid) {
+                add_selector_flags(selector, term + 5);
+            }
+        } else if (!strcmp(term, "active")) {
+            add_selector_flags(selector, FLAG_ACTIVE);
+        } else if (!strcmp(term, "under-pointer")) {
+            add_selector_flags(selector, FLAG_POINTER);
+        } else if (!strcmp(term, "fullscreen")) {
+            add_selector_flags(selector, FLAG_FULLSCREEN);
+        } else if (!strcmp(term, "above")) {
+            add_selector_flags(selector, FLAG_ABOVE);
+        } else if (!strcmp(term, "iconic")) {
+            add_selector_flags(selector, FLAG_ICONIC);
+        } else if (!strcmp(term, "mapped")) {
+            selector->mapped = true;
+        } else {
+            valid = false;
+        }
+    }
+    free(terms);
+    return valid;
+}
+
+void free_selector(Selector *selector) {
+    free(selector->instance);
+    free(selector->class);
+    free(selector->name);
+}
+
+bool match_pattern(const char *pattern, const char *string) {
+    return !pattern || !fnmatch(pattern, string ? string : "", 0);
+}
+
+bool match_selector(Selector *selector, Client *client, xcb_window_t pointer) {
+    char flags[FLAG_COUNT];
+
+    if (!is_managed_window(client->window) ||
+        (selector->window && client->window != selector->window) ||
+        (selector->pid && client->pid != selector->pid) ||
+        (selector->mapped && client->map_state != XCB_MAP_STATE_VIEWABLE) ||
+        !match_pattern(selector->instance, client->instance) ||
+        !match_pattern(selector->class, client->class) ||
+        !match_pattern(selector->name, client->name)) {
+        return false;
+    }
+    get_client_flags(client, pointer, flags);
+    return strspn(selector->flags, flags) == strlen(selector->flags);
+}
+
+bool is_literal(const char *pattern) {
+    return pattern && !strpbrk(pattern, "*?[\\");
+}
+
+/* the managed windows matching selector, taken from the narrowest index
+ * that applies, in no particular order */
+unsigned int select_windows(Selector *selector, xcb_window_t **windows) {
+    Client **index = NULL;
+    Client *client;
+    xcb_window_t pointer = XCB_WINDOW_NONE;
+    unsigned int nwindows = 0;
+    unsigned int size = 0;
+
+    *windows = NULL;
+    refresh_clients();
+    if (strchr(selector->flags, *FLAG_POINTER)) {
+        pointer = get_pointer_reply(xcb_query_pointer(connection, root));
+    }
+    if (selector->window) {
+        client = get_client(selector->window);
+    } else if (is_literal(selector->class)) {
+        index = class_index;
+        client = class_index[string_bucket(selector->class)];
+    } else if (is_literal(selector->instance)) {
+        index = instance_index;
+        client = instance_index[string_bucket(selector->instance)];
+    } else if (selector->pid) {
+        index = pid_index;
+        client = pid_index[selector->pid % CLIENT_BUCKETS];
+    } else {
+        client = top_client;
+    }
+    for (; client; client = index ? *get_index_link(index, client) : client->below) {
+        if (match_selector(selector, client, pointer)) {
+            if (nwindows == size) {
+                size = size ? size * 2 : 4;
+                *windows = realloc(*windows, size * sizeof(xcb_window_t));
+            }
+            (*windows)[nwindows++] = client->window;
+        }
+        if (selector->window) {
+            break;
+        }
+    }
+    return nwindows;
+}
+
+/* the windows named by a command argument, a window or a selector */
+unsigned int get_selected_windows(const char *arg, xcb_window_t **windows) {
+    Selector selector;
+    xcb_window_t window;
+    unsigned int nwindows = 0;
+
+    *windows = NULL;
+    if (sscanf(arg, "0x%x", &window) || sscanf(arg, "%u", &window)) {
+        *windows = malloc(sizeof(xcb_window_t));
+        (*windows)[nwindows++] = window;
+        return nwindows;
+    }
+    memset(&selector, 0, sizeof(selector));
+    if (parse_selector(&selector, arg)) {
+        nwindows = select_windows(&selector, windows);
+    }
+    free_selector(&selector);
+    return nwindows;
+}
+
+/* the managed windows, topmost first, then root */
+void print_windows(FILE *stream, xcb_window_t pointer) {
+    xcb_window_t *windows = NULL;
+    unsigned int nwindows;
+    xcb_window_t active = get_active_window();
+    char flags[FLAG_COUNT];
+
+    refresh_clients();
+    nwindows = get_managed_windows(&windows);
+    for (unsigned int i = 0; i < nwindows; i++) {
+        flags[0] = '\0';
+        if (windows[i] == active) {
+            strcat(flags, FLAG_ACTIVE);
+        }
+        if (windows[i] == pointer) {
+            strcat(flags, FLAG_POINTER);
+        }
+        print_window(stream, NULL, windows[i], flags);
+    }
+    if (windows) {
+        free(windows);
+    }
+    print_window(stream, NULL, root, NULL);
+}
+
+/* everything on the window's line but the pointer flag */
+uint32_t hash_client(Client *client) {
+    int values[] = {
+        client->x, client->y, client->width, client->height, client->pid,
+        is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_FULLSCREEN]),
+        is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_ABOVE]),
+        client->wm_state == IconicState,
+        client->window == get_active_window()
+    };
+    uint32_t hash = 2166136261;
+
+    hash = hash_bytes(hash, values, sizeof(values));
+    hash = hash_string(hash, client->instance);
+    hash = hash_string(hash, client->class);
+    return hash_string(hash, client->name);
+}
+
+/* Compare every line of the windows output with what it was and stamp the
+ * ones that changed, or appeared, with a new generation. Only content is
+ * compared; a restack alone doesn't change a line. */
+void update_generation() {
+    Client *client;
+    bool listed;
+    uint32_t hash;
+    bool changed = nremovals && removals[nremovals - 1].generation > generation;
+    int size[] = { screen_width, screen_height };
+
+    refresh_clients();
+    for (client = top_client; client; client = client->below) {
+        listed = is_managed_window(client->window);
+        hash = listed ? hash_client(client) : 0;
+        if (listed != client->listed || hash != client->hash) {
+            if (!listed) {
+                add_removal(client->window);
+            }
+            client->listed = listed;
+            client->hash = hash;
+            client->generation = generation + 1;
+            changed = true;
+        }
+    }
+    hash = hash_bytes(2166136261, size, sizeof(size));
+    if (hash != root_hash) {
+        root_hash = hash;
+        root_generation = generation + 1;
+        changed = true;
+    }
+    if (changed) {
+        generation++;
+    }
+}
+
+/* windows --since <generation>: the lines that changed after it and the
+ * windows that left the output, or every line if the removals no longer
+ * reach back that far */
+void print_windows_since(FILE *stream, unsigned long since) {
+    Client *client;
+    xcb_window_t active = get_active_window();
+    bool full;
+
+    update_generation();
+    full = since < removals_floor || since > generation;
+    fprintf(stream, "generation\t%lu\t%s\n", generation, full ? "full" : "diff");
+    for (client = top_client; client; client = client->below) {
+        if (client->listed && (full || client->generation > since)) {
+            print_window(stream, NULL, client->window,
+                         client->window == active ? FLAG_ACTIVE : NULL);
+        }
+    }
+    for (int i = 0; !full && i < nremovals; i++) {
+        if (removals[i].generation > since &&
+            !((client = get_client(removals[i].window)) && client->listed)) {
+            fprintf(stream, "removed\t0x%07x\n", removals[i].window);
+        }
+    }
+    if (full || root_generation > since) {
+        print_window(stream, NULL, root, NULL);
+    }
+}
+
+/* Publish the windows output, without the pointer flag, in the snapshot
+ * file. Readers check that the sequence is even and unchanged around their
+ * copy, so it is made odd for the duration of the rewrite. It is only
+ * rewritten when the generation moved, so like windows --since it doesn't
+ * follow a restack alone. */
+void write_snapshot() {
+    FILE *stream;
+    char *text = NULL;
+    size_t length = 0;
+    size_t size;
+    void *map;
+
+    if (!snapshot || (snapshot->length && generation == snapshot_generation)) {
+        return;
+    }
+    if (!(stream = open_memstream(&text, &length))) {
+        return;
+    }
+    print_windows(stream, XCB_WINDOW_NONE);
+    fclose(stream);
+
+    if (sizeof(WmcSnapshotHeader) + length > snapshot->size) {
+        size = snapshot->size;
+        while (sizeof(WmcSnapshotHeader) + length > size) {
+            size *= 2;
+        }
+        if (ftruncate(snapshot_fd, size) == -1 ||
+            (map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, snapshot_fd, 0)) == MAP_FAILED) {
+            free(text);
+            return;
+        }
+        munmap(snapshot, snapshot->size);
+        snapshot = map;
+        snapshot->size = size;
+    }
+
+    __atomic_store_n(&snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(snapshot + 1, text, length);
+    snapshot->length = length;
+    __atomic_store_n(&snapshot->sequence, snapshot->sequence + 1, __ATOMIC_RELEASE);
+    snapshot_generation = generation;
+
+    free(text);
+}
+
+/* Map the snapshot file, keeping the sequence of one left by a restart.
+ * The name is predictable and may be in /tmp, so a symlink or a file
+ * someone else owns is refused rather than written through. */
+void open_snapshot(const char *path) {
+    struct stat st;
+    size_t size = 1 << 16;
+    void *map;
+
+    if ((snapshot_fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600)) == -1) {
+        return;
+    }
+    if (fstat(snapshot_fd, &st) == -1 ||
+        !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        fchmod(snapshot_fd, 0600) == -1 ||
+        ((size_t) st.st_size < size && ftruncate(snapshot_fd, size) == -1)) {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        return;
+    }
+    if ((size_t) st.st_size > size) {
+        size = st.st_size;
+    }
+    if ((map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, snapshot_fd, 0)) == MAP_FAILED) {
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        return;
+    }
+    snapshot = map;
+    snapshot->magic = WMC_SNAPSHOT_MAGIC;
+    snapshot->size = size;
+    /* a crash may have left the sequence odd */
+    snapshot->sequence += snapshot->sequence & 1;
+}
+
+/* Save the state a restart would lose, see HandoffHeader. It is written to
+ * a fresh private file and renamed into place, so nothing already at the
+ * predictable name, such as a symlink in /tmp, is ever written through. */
+void write_handoff(const char *path) {
+    FILE *file;
+    char temp_path[PATH_MAX];
+    int fd;
+    HandoffHeader header = {
+        HANDOFF_MAGIC, sizeof(HandoffHeader), sizeof(*removals), sizeof(HandoffClient),
+        screen_width, screen_height,
+        generation, root_generation, root_hash, removals_floor, nremovals,
+        map_count, 0
+    };
+    HandoffClient record;
+    Client *client;
+
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    if ((fd = mkstemp(temp_path)) == -1) {
+        return;
+    }
+    if (!(file = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+    for (client = top_client; client; client = client->below) {
+        header.nclients++;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(removals, sizeof(*removals), nremovals, file);
+    for (client = top_client; client; client = client->below) {
+        memset(&record, 0, sizeof(record));
+        record.window = client->window;
+        record.listed = client->listed;
+        record.hash = client->hash;
+        record.generation = client->generation;
+        record.map_order = client->map_order;
+        record.cell = client->cell;
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    if (fclose(file) || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+    }
+}
+
+/* Take over the state left by write_handoff(), once the existing windows
+ * are adopted. A window that went away in between counts as removed; one
+ * that appeared in between is simply new. The names behind the hashes are
+ * fetched again, so the generation only moves if something changed. */
+void read_handoff(const char *path) {
+    FILE *file;
+    HandoffHeader header;
+    HandoffClient record;
+    Client *client;
+    bool cells;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+        return;
+    }
+    unlink(path);
+    /* only trust a file a previous wmd of ours left */
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        !(file = fdopen(fd, "r"))) {
+        close(fd);
+        return;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != HANDOFF_MAGIC ||
+        header.header_size != sizeof(HandoffHeader) ||
+        header.removal_size != sizeof(*removals) ||
+        header.client_size != sizeof(HandoffClient) ||
+        header.nremovals < 0 || header.nremovals > REMOVALS_MAX ||
+        fread(removals, sizeof(*removals), header.nremovals, file) != (size_t) header.nremovals) {
+        fclose(file);
+        return;
+    }
+    generation = header.generation;
+    root_generation = header.root_generation;
+    root_hash = header.root_hash;
+    removals_floor = header.removals_floor;
+    nremovals = header.nremovals;
+    if (header.map_count > map_count) {
+        map_count = header.map_count;
+    }
+    /* the cells are only good for the same screen */
+    cells = header.screen_width == screen_width && header.screen_height == screen_height;
+
+    for (int i = 0; i < header.nclients && fread(&record, sizeof(record), 1, file) == 1; i++) {
+        if ((client = get_client(record.window))) {
+            client->listed = record.listed;
+            client->hash = record.hash;
+            client->generation = record.generation;
+            client->map_order = record.map_order;
+            if (cells) {
+                client->cell = record.cell;
+            }
+        } else if (record.listed) {
+            add_removal(record.window);
+        }
+    }
+    fclose(file);
+}
+
+void write_ring(Peer *peer, const char *data, size_t length) {
+    size_t end = (peer->ring_start + peer->ring_len) % SUBSCRIBER_BUFFER;
+    size_t first = length < SUBSCRIBER_BUFFER - end ? length : SUBSCRIBER_BUFFER - end;
+
+    memcpy(peer->ring + end, data, first);
+    memcpy(peer->ring, data + first, length - first);
+    peer->ring_len += length;
+}
+
+/* Queue an event line for a subscriber, or count it as dropped if the ring
+ * is full. The count is reported in a line of its own ahead of the next
+ * event that fits. */
+void queue_event(Peer *peer, const char *line, size_t length) {
+    char notice[32];
+    size_t notice_length = 0;
+
+    if (peer->dropped) {
+        notice_length = snprintf(notice, sizeof(notice), "dropped\t%lu\n", peer->dropped);
+    }
+    if (peer->ring_len + notice_length + length > SUBSCRIBER_BUFFER) {
+        peer->dropped++;
+        stats.events_dropped++;
+        return;
+    }
+    if (!peer->ring) {
+        peer->ring = malloc(SUBSCRIBER_BUFFER);
+    }
+    write_ring(peer, notice, notice_length);
+    write_ring(peer, line, length);
+    peer->dropped = 0;
+}
+
+/* write the window line to the FIFO and to every subscriber to this type of
+ * event, the latter prefixed with the type */
+void publish_event(int type, xcb_window_t window, char *flags) {
+    Peer *peer;
+    FILE *stream;
+    char *line = NULL;
+    size_t length = 0;
+    bool subscribed = false;
+    long long start;
+
+    for (peer = peers; peer; peer = peer->next) {
+        subscribed |= peer->subscribed && peer->event_mask & 1 << type;
+    }
+    if (!subscribed) {
+        start = trace_start();
+        print_window(fifo, prefix, window, flags);
+        trace_end("wm", "fifo", start);
+        return;
+    }
+    if (!(stream = open_memstream(&line, &length))) {
+        return;
+    }
+    fprintf(stream, "%s\t", event_names[type]);
+    print_window(stream, NULL, window, flags);
+    fclose(stream);
+
+    if (fifo) {
+        start = trace_start();
+        fprintf(fifo, "%s%s", prefix, line + strlen(event_names[type]) + 1);
+        fflush(fifo);
+        trace_end("wm", "fifo", start);
+    }
+    for (peer = peers; peer; peer = peer->next) {
+        if (peer->subscribed && peer->event_mask & 1 << type) {
+            queue_event(peer, line, length);
+        }
+    }
+    free(line);
+}
+
+/* a window, the cells of the grid it is to cover and, once fitted, the
+ * geometry that covers them */
+typedef struct {
+    xcb_window_t window;
+    Cell cell;
+    xcb_get_property_cookie_t hints_cookie;
+    xcb_get_property_cookie_t motif_cookie;
+    int window_x;
+    int window_y;
+    int window_width;
+    int window_height;
+    int border_size;
+} Tile;
+
+/* fit the window to its cells, within what its hints allow */
+void fit_tile(Tile *tile) {
+    int tile_width = (screen_width - gap_size) / tile->cell.grid_width;
+    int tile_height = (screen_height - top_padding - gap_size) / tile->cell.grid_height;
+    SizeHints hints;
+    bool undecorated;
+    Client *client;
+    xcb_atom_t type;
+    int window_border;
+    int window_x;
+    int window_y;
+    int window_width;
+    int window_height;
+
+    client = get_client(tile->window);
+    get_hints_reply(client, tile->hints_cookie, tile->motif_cookie, &hints, &undecorated);
+    window_border = undecorated ? 0 : border_size;
+
+    type = client ? client->type : XCB_ATOM_NONE;
+
+    window_x = gap_size + tile_width * tile->cell.x;
+    window_y = top_padding + gap_size + tile_height * tile->cell.y;
+    window_width = tile_width * tile->cell.width - gap_size - window_border * 2;
+    window_height = tile_height * tile->cell.height - gap_size - window_border * 2;
+
+    if (hints.flags & PPosition && hints.flags & PSize) {
+        window_x = hints.x;
+        window_y = hints.y;
+        window_width = hints.width;
+        window_height = hints.height;
+    } else if (type == net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] ||
+               type == net_atoms[_NET_WM_WINDOW_TYPE_SPLASH]) {
+        if (client && client->width < window_width) {
+            window_x += (window_width - client->width) / 2;
+            window_width = client->width;
+        }
+        if (client && client->height < window_height) {
+            window_y += (window_height - client->height) / 2;
+            window_height = client->height;
+        }
+    } else if (hints.flags & PMaxSize &&
+               (hints.max_width < window_width ||
+                hints.max_height < window_height)) {
+        if (hints.max_width < window_width) {
+            window_x += (window_width - hints.max_width) / 2;
+            window_width = hints.max_width;
+        }
+        if (hints.max_height < window_height) {
+            window_y += (window_height - hints.max_height) / 2;
+            window_height = hints.max_height;
+        }
+    } else if (hints.flags & PAspect) {
+    }
+
+    if (hints.flags & PResizeInc) {
+        if (hints.width_inc) {
+            window_width -= window_width % hints.width_inc;
+        }
+        if (hints.height_inc) {
+            window_height -= window_height % hints.height_inc;
+        }
+    }
+
+    tile->window_x = window_x;
+    tile->window_y = window_y;
+    tile->window_width = window_width;
+    tile->window_height = window_height;
+    tile->border_size = window_border;
+}
+
+/* Fit every window to its cells. The hints of all of the windows are
+ * requested before any reply is waited on and the geometries are all sent
+ * together, under a server grab if asked, so the arrangement lands at
+ * once. Windows already in place are left. */
+void tile_windows(Tile *tiles, int ntiles, bool grab) {
+    Tile *tile;
+    Client *client;
+
+    for (tile = tiles; tile < tiles + ntiles; tile++) {
+        request_hints(get_client(tile->window), tile->window,
+                      &tile->hints_cookie, &tile->motif_cookie);
+    }
+    for (tile = tiles; tile < tiles + ntiles; tile++) {
+        fit_tile(tile);
+    }
+
+    if (grab) {
+        xcb_grab_server(connection);
+    }
+    for (tile = tiles; tile < tiles + ntiles; tile++) {
+        if ((client = get_client(tile->window))) {
+            client->cell = tile->cell;
+        }
+        set_net_wm_state(tile->window, net_atoms[_NET_WM_STATE_FULLSCREEN], false);
+        set_geometry(tile->window, tile->window_x, tile->window_y,
+                     tile->window_width, tile->window_height, tile->border_size);
+    }
+    if (grab) {
+        xcb_ungrab_server(connection);
+    }
+}
+
+void tile_window(xcb_window_t window,
+                 int grid_width,
+                 int grid_height,
+                 int width,
+                 int height,
+                 int x,
+                 int y) {
+    Tile tile = { .window = window, .cell = { grid_width, grid_height, width, height, x, y } };
+
+    tile_windows(&tile, 1, false);
+}
+
+bool parse_grid(const char *arg, int *grid_width, int *grid_height) {
+    return (sscanf(arg, "%dx%d", grid_width, grid_height) == 2 &&
+            *grid_width > 0 && *grid_height > 0);
+}
+
+bool parse_cell(const char *arg, int grid_width, int grid_height,
+                int *width, int *height, int *x, int *y) {
+    return (sscanf(arg, "%dx%d+%d+%d", width, height, x, y) == 4 &&
+            *width >= 1 && *height >= 1 && *width <= grid_width && *height <= grid_height &&
+            *x >= 0 && *y >= 0 && *x < grid_width && *y < grid_height);
+}
+
+/* layout [--grab] <grid_w>x<grid_h> (<w>x<h>+<x>+<y> <window|selector>)...:
+ * every window into its own cells in a single batch */
+bool layout_windows(char **args, int nargs) {
+    Tile *tiles = NULL;
+    int ntiles = 0;
+    bool grab = false;
+    xcb_window_t *windows;
+    unsigned int nwindows;
+    Tile tile;
+    int i = 0;
+
+    if (i < nargs && !strcmp(args[i], "--grab")) {
+        grab = true;
+        i++;
+    }
+    if (i == nargs ||
+        !parse_grid(args[i++], &tile.cell.grid_width, &tile.cell.grid_height) ||
+        (nargs - i) % 2) {
+        return false;
+    }
+    for (; i < nargs; i += 2) {
+        if (!parse_cell(args[i], tile.cell.grid_width, tile.cell.grid_height,
+                        &tile.cell.width, &tile.cell.height, &tile.cell.x, &tile.cell.y)) {
+            free(tiles);
+            return false;
+        }
+        nwindows = get_selected_windows(args[i + 1], &windows);
+        tiles = realloc(tiles, (ntiles + nwindows) * sizeof(Tile));
+        for (unsigned int j = 0; j < nwindows; j++) {
+            if (is_managed_window(windows[j])) {
+                tile.window = windows[j];
+                tiles[ntiles++] = tile;
+            }
+        }
+        free(windows);
+    }
+    tile_windows(tiles, ntiles, grab);
+    free(tiles);
+    return true;
+}
+
+/* what is_laid_out() asks of the window itself, known before it is mapped */
+bool is_layout_kind(Client *client) {
+    return (client->layer == LAYER_NORMAL &&
+            client->type != net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] &&
+            client->type != net_atoms[_NET_WM_WINDOW_TYPE_SPLASH]);
+}
+
+bool is_laid_out(Client *client) {
+    return (is_normal_window(client->window) &&
+            !is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_FULLSCREEN]) &&
+            is_layout_kind(client));
+}
+
+int compare_map_order(const void *a, const void *b) {
+    unsigned long order_a = (*(Client **) a)->map_order;
+    unsigned long order_b = (*(Client **) b)->map_order;
+
+    return order_a < order_b ? 1 : order_a > order_b ? -1 : 0;
+}
+
+/* the cells of the i-th of n windows, newest first */
+Cell get_layout_cell(int layout, int i, int n) {
+    Cell cell = { 1, 1, 1, 1, 0, 0 };
+    int columns;
+
+    switch (layout) {
+        case LAYOUT_MASTER:
+            if (n > 1) {
+                cell.grid_width = 2;
+                cell.grid_height = n - 1;
+                cell.height = i ? 1 : n - 1;
+                cell.x = i ? 1 : 0;
+                cell.y = i ? i - 1 : 0;
+            }
+            break;
+        case LAYOUT_GRID:
+            for (columns = 1; columns * columns < n; columns++);
+            cell.grid_width = columns;
+            cell.grid_height = (n + columns - 1) / columns;
+            cell.x = i % columns;
+            cell.y = i / columns;
+            break;
+        case LAYOUT_COLUMNS:
+            cell.grid_width = n;
+            cell.x = i;
+            break;
+    }
+    return cell;
+}
+
+/* tile the windows again in their cells, as after the gaps or borders change */
+void retile_windows() {
+    Client *client;
+    Tile *tiles;
+    int ntiles = 0;
+
+    for (client = top_client; client; client = client->below) {
+        ntiles++;
+    }
+    tiles = malloc(ntiles * sizeof(Tile));
+    ntiles = 0;
+    for (client = top_client; client; client = client->below) {
+        if (client->cell.grid_width &&
+            is_managed_window(client->window) &&
+            !is_net_wm_state_set(client->window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
+            tiles[ntiles].window = client->window;
+            tiles[ntiles++].cell = client->cell;
+        }
+    }
+    tile_windows(tiles, ntiles, false);
+    free(tiles);
+}
+
+/* forget the cells given out, so the next arrangement places every window */
+void reset_layout() {
+    Client *client;
+
+    for (client = top_client; client; client = client->below) {
+        memset(&client->cell, 0, sizeof(client->cell));
+    }
+}
+
+/* Give the normal windows their cells in the automatic layout, the newest
+ * window first. Only windows whose cells changed since the last
+ * arrangement are tiled, so mapping or unmapping one window touches just
+ * the ones that have to move. */
+void arrange_windows() {
+    Client **laid_out;
+    Client *client;
+    Tile *tiles;
+    int n = 0;
+    int ntiles = 0;
+    Cell cell;
+
+    if (auto_layout == LAYOUT_NONE) {
+        return;
+    }
+    for (client = top_client; client; client = client->below) {
+        n++;
+    }
+    laid_out = malloc(n * sizeof(Client *));
+    n = 0;
+    for (client = top_client; client; client = client->below) {
+        if (is_laid_out(client)) {
+            laid_out[n++] = client;
+        } else {
+            memset(&client->cell, 0, sizeof(client->cell));
         }
-        if (hints.height_inc) {
-            window_height -= window_height % hints.height_inc;
+    }
+    qsort(laid_out, n, sizeof(Client *), compare_map_order);
+
+    tiles = malloc(n * sizeof(Tile));
+    for (int i = 0; i < n; i++) {
+        cell = get_layout_cell(auto_layout, i, n);
+        if (memcmp(&cell, &laid_out[i]->cell, sizeof(cell))) {
+            laid_out[i]->cell = cell;
+            tiles[ntiles].window = laid_out[i]->window;
+            tiles[ntiles++].cell = cell;
         }
     }
-
-    set_net_wm_state(window, net_atoms[_NET_WM_STATE_FULLSCREEN], False);
-    XSetWindowBorderWidth(display, window, border_size);
-    XMoveResizeWindow(display, window, window_x, window_y, window_width, window_height);
+    tile_windows(tiles, ntiles, false);
+    free(tiles);
+    free(laid_out);
 }
 
-void fullscreen_window(Window window) {
-    set_net_wm_state(window, net_atoms[_NET_WM_STATE_FULLSCREEN], True);
-    XMoveResizeWindow(display, window, 0, 0, screen_width, screen_height);
-    XSetWindowBorderWidth(display, window, 0);
-    XRaiseWindow(display, window);
+/* back from fullscreen, into the layout or filling the screen */
+void restore_window(xcb_window_t window) {
+    if (auto_layout == LAYOUT_NONE) {
+        tile_window(window, 1, 1, 1, 1, 0, 0);
+    } else {
+        set_net_wm_state(window, net_atoms[_NET_WM_STATE_FULLSCREEN], false);
+    }
 }
 
-void raise_window(Window window) {
-    Window *windows = NULL;
-    unsigned int nwindows;
+/* map the window, taking it as viewable rather than waiting on MapNotify */
+void show_window(xcb_window_t window) {
+    Client *client;
 
-    nwindows = get_windows(&is_above_window, &windows);
-    if (!nwindows) {
-        XRaiseWindow(display, window);
-    } else {
-        XWindowChanges changes;
-        changes.sibling = windows[nwindows - 1];
-        changes.stack_mode = Below;
-        XConfigureWindow(display, window, CWSibling|CWStackMode, &changes);
+    if ((client = get_client(window))) {
+        client->map_state = XCB_MAP_STATE_VIEWABLE;
     }
+    xcb_map_window(connection, window);
+}
 
-    if (windows) {
-        XFree(windows);
+void fullscreen_window(xcb_window_t window) {
+    uint32_t above = XCB_STACK_MODE_ABOVE;
+
+    set_net_wm_state(window, net_atoms[_NET_WM_STATE_FULLSCREEN], true);
+    set_geometry(window, 0, 0, screen_width, screen_height, 0);
+    configure(window, XCB_CONFIG_WINDOW_STACK_MODE, &above);
+}
+
+/* raise the window to the top of its layer */
+void raise_window(xcb_window_t window) {
+    Client *client = get_client(window);
+    Client *ceiling;
+    long long start = trace_start();
+
+    ceiling = get_layer_ceiling(client ? client->layer : LAYER_NORMAL);
+    if (!ceiling) {
+        uint32_t above = XCB_STACK_MODE_ABOVE;
+        configure(window, XCB_CONFIG_WINDOW_STACK_MODE, &above);
+    } else {
+        uint32_t values[] = { ceiling->window, XCB_STACK_MODE_BELOW };
+        configure(window, XCB_CONFIG_WINDOW_SIBLING|XCB_CONFIG_WINDOW_STACK_MODE, values);
     }
+    trace_end("wm", "raise_window", start);
 }
 
-void activate_window(Window window) {
-    Window active;
+void activate_window(xcb_window_t window) {
+    xcb_window_t active;
+    long long start = trace_start();
 
     active = get_active_window();
 
-    if (window == None || window == root) {
+    if (window == XCB_WINDOW_NONE || window == root) {
         if (active && is_normal_window(active)) {
             window = active;
         } else {
@@ -664,49 +2785,93 @@ void activate_window(Window window) {
     }
     if (is_managed_window(window)) {
         if (get_wm_state(window) == IconicState) {
-            iconify_window(window, False);
+            iconify_window(window, false);
         }
         if (active && window != active) {
-            XSetWindowBorder(display, active, background);
+            set_border_color(active, background);
         }
-        XSetInputFocus(display, window, RevertToPointerRoot, CurrentTime);
+        xcb_set_input_focus(connection, XCB_INPUT_FOCUS_POINTER_ROOT, window, XCB_CURRENT_TIME);
         if (window != active) {
-            XSetWindowBorder(display, window, foreground);
+            set_border_color(window, foreground);
             raise_window(window);
             send_protocol(window, wm_atoms[WM_TAKE_FOCUS]);
             set_window_property(root, net_atoms[_NET_ACTIVE_WINDOW], window);
-            print_window(fifo, prefix, window, FLAG_ACTIVE);
+            active_window = window;
+            publish_event(EVENT_ACTIVE, window, FLAG_ACTIVE);
+            get_client(window)->title_changed = false;
         }
     } else if (active) {
-        set_window_property(root, net_atoms[_NET_ACTIVE_WINDOW], None);
-        print_window(fifo, prefix, None, NULL);
+        set_window_property(root, net_atoms[_NET_ACTIVE_WINDOW], XCB_WINDOW_NONE);
+        active_window = XCB_WINDOW_NONE;
+        publish_event(EVENT_ACTIVE, XCB_WINDOW_NONE, NULL);
+    }
+    trace_end("wm", "activate_window", start);
+}
+
+/* write the line for a retitled active window once per batch, or once the
+ * title interval has passed */
+void flush_titles() {
+    Client *client;
+    long long elapsed;
+
+    if (!titles_changed || title_timer.pending) {
+        return;
+    }
+    elapsed = get_time() - title_time;
+    if (elapsed < title_interval) {
+        add_timer(&title_timer, title_interval - elapsed);
+        return;
+    }
+
+    titles_changed = false;
+    for (client = top_client; client; client = client->below) {
+        if (client->title_changed) {
+            client->title_changed = false;
+            if (client->window == get_active_window()) {
+                publish_event(EVENT_TITLE, client->window, FLAG_ACTIVE);
+                title_time = get_time();
+            }
+        }
     }
 }
 
-void iconify_window(Window window, Bool iconify) {
+void title_timeout(Timer *timer) {
+    flush_titles();
+}
+
+void iconify_window(xcb_window_t window, bool iconify) {
     if (iconify) {
         set_wm_state(window, IconicState);
-        XUnmapWindow(display, window);
-        Window focus;
-        int revert_to;
-        XGetInputFocus(display, &focus, &revert_to);
-        if (window == focus) {
-            XSetInputFocus(display, root, RevertToPointerRoot, CurrentTime);
+        xcb_unmap_window(connection, window);
+        xcb_get_input_focus_reply_t *focus;
+        long long start = trace_start();
+        replies_waited++;
+        focus = xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL);
+        trace_end("x", "GetInputFocus", start);
+        if (focus && window == focus->focus) {
+            xcb_set_input_focus(connection, XCB_INPUT_FOCUS_POINTER_ROOT, root, XCB_CURRENT_TIME);
         }
+        free(focus);
     } else {
-        XMapWindow(display, window);
+        show_window(window);
         set_wm_state(window, NormalState);
     }
 }
 
 /* quit */
 /* restart */
-/* windows */
-/* activate <window>... */
-/* tile <grid_w>x<grid_h> <w>x<h>x+<x>+<y> <window>... */
-/* delete <window>... */
-/* fullscreen <window>... */
+/* windows [--since <generation>] */
+/* activate <window|selector>... */
+/* tile <grid_w>x<grid_h> <w>x<h>x+<x>+<y> <window|selector>... */
+/* autolayout [none|master|grid|columns] */
+/* layout [--grab] <grid_w>x<grid_h> (<w>x<h>+<x>+<y> <window|selector>)... */
+/* delete <window|selector>... */
+/* fullscreen <window|selector>... */
 /* restore <windows> */
+/* stats [reset] */
+/* trace on|off|dump */
+/* subscribe [active|title|root]..., see subscribe_peer() */
+/* wait [--timeout <ms>] <condition>..., see wait_peer() */
 
 void handle_command(char *cmd_buf, int cmd_len, FILE *response)
 {
@@ -716,7 +2881,7 @@ void handle_command(char *cmd_buf, int cmd_len, FILE *response)
     int args_len = 0;
     int beg = 0;
 
-    for (int i = 0; i <= cmd_len; i++) {
+    for (int i = 0; i < cmd_len; i++) {
         if (cmd_buf[i] == '\0') {
             if (args_len == args_size) {
                 args_size *= 2;
@@ -730,33 +2895,52 @@ void handle_command(char *cmd_buf, int cmd_len, FILE *response)
     if (args_len == 0) {
         fprintf(response, "%c", '1');
     } else if (!strcmp(args[0], "quit")) {
-        quit = True;
+        quit = true;
         fprintf(response, "%c", '0');
     } else if (!strcmp(args[0], "restart")) {
-        restart = True;
+        restart = true;
         fprintf(response, "%c", '0');
-    } else if (!strcmp(args[0], "windows")) {
-        Window *windows = NULL;
-        unsigned int nwindows;
+    } else if (!strcmp(args[0], "trace") && args_len == 2 &&
+               (!strcmp(args[1], "on") || !strcmp(args[1], "off"))) {
+        set_tracing(!strcmp(args[1], "on"));
         fprintf(response, "%c", '0');
-        Window pointer = get_pointer_window();
-        Window active = get_active_window();
-        char flags[FLAG_COUNT];
-        nwindows = get_managed_windows(&windows);
-        for (unsigned int i = 0; i < nwindows; i++) {
-            flags[0] = '\0';
-            if (windows[i] == active) {
-                strcat(flags, FLAG_ACTIVE);
-            }
-            if (windows[i] == pointer) {
-                strcat(flags, FLAG_POINTER);
-            }
-            print_window(response, NULL, windows[i], flags);
+    } else if (!strcmp(args[0], "trace") && args_len == 2 && !strcmp(args[1], "dump")) {
+        fprintf(response, "%c", '0');
+        print_trace(response);
+    } else if (!strcmp(args[0], "stats") && args_len == 2 && !strcmp(args[1], "reset")) {
+        reset_stats();
+        fprintf(response, "%c", '0');
+    } else if (!strcmp(args[0], "stats")) {
+        fprintf(response, "%c", '0');
+        fprintf(response, "events\t%lu\n", stats.events);
+        fprintf(response, "commands\t%lu\n", stats.commands);
+        fprintf(response, "syncs_saved\t%lu\n", stats.syncs_saved);
+        fprintf(response, "events_dropped\t%lu\n", stats.events_dropped);
+        fprintf(response, "writes_saved\t%lu\n", stats.writes_saved);
+        fprintf(response, "ready_ms\t%lu\n", stats.ready_ms);
+        for (int i = 0; i < 128; i++) {
+            char number[4];
+            snprintf(number, sizeof(number), "%d", i);
+            print_handler_stats(response, "event", event_type_names[i] ? event_type_names[i] : number,
+                                &event_stats[i]);
+        }
+        for (unsigned int i = 0; i < COMMAND_COUNT; i++) {
+            print_handler_stats(response, "command", command_names[i], &command_stats[i]);
         }
-        if (windows) {
-            XFree(windows);
+    } else if (!strcmp(args[0], "windows") && args_len == 3 && !strcmp(args[1], "--since")) {
+        fprintf(response, "%c", '0');
+        print_windows_since(response, strtoul(args[2], NULL, 10));
+    } else if (!strcmp(args[0], "windows")) {
+        fprintf(response, "%c", '0');
+        print_windows(response, get_pointer_reply(xcb_query_pointer(connection, root)));
+    } else if (!strcmp(args[0], "autolayout") && args_len <= 2) {
+        if (args_len == 1) {
+            fprintf(response, "%c%s\n", '0', layout_names[auto_layout]);
+        } else {
+            fprintf(response, "%c", set_auto_layout(args[1]) ? '0' : '1');
         }
-        print_window(response, NULL, root, NULL);
+    } else if (!strcmp(args[0], "layout")) {
+        fprintf(response, "%c", layout_windows(args + 1, args_len - 1) ? '0' : '1');
     } else if (args_len == 1) {
         fprintf(response, "%c", '1');
     } else {
@@ -767,221 +2951,777 @@ void handle_command(char *cmd_buf, int cmd_len, FILE *response)
         int h;
         int x;
         int y;
-        Window window;
+        xcb_window_t window;
+        xcb_window_t *windows;
+        unsigned int nwindows;
         if (!strcmp(args[0], "tile") &&
              (args_len < 4 ||
-              sscanf(args[i++], "%dx%d", &grid_w, &grid_h) < 2 ||
-              sscanf(args[i++], "%dx%d+%d+%d", &w, &h, &x, &y) < 4 ||
-              grid_w < 0 || grid_h < 0 ||
-              w < 1 || h < 1 || w > grid_w || h > grid_h ||
-              x < 0 || y < 0 || x >= grid_w || y >= grid_h)) {
+              !parse_grid(args[i++], &grid_w, &grid_h) ||
+              !parse_cell(args[i++], grid_w, grid_h, &w, &h, &x, &y))) {
             fprintf(response, "%c", '1');
             i = args_len;
         } else {
             fprintf(response, "%c", '0');
         }
         for (; i < args_len; i++) {
-            if (!sscanf(args[i], "0x%lx", &window) &&
-                !sscanf(args[i], "%lu", &window)) {
-            } else if (!is_managed_window(window)) {
-            } else if (!strcmp(args[0], "activate")) {
-                activate_window(window);
-            } else if (!strcmp(args[0], "delete")) {
-                send_protocol(window, wm_atoms[WM_DELETE_WINDOW]);
-            } else if (!strcmp(args[0], "fullscreen")){
-                fullscreen_window(window);
-            } else if (!strcmp(args[0], "tile")) {
-                tile_window(window, grid_w, grid_h, w, h, x, y);
-            } else if (!strcmp(args[0], "iconify")) {
-                iconify_window(window, True);
+            nwindows = get_selected_windows(args[i], &windows);
+            for (unsigned int j = 0; j < nwindows; j++) {
+                window = windows[j];
+                if (!is_managed_window(window)) {
+                } else if (!strcmp(args[0], "activate")) {
+                    activate_window(window);
+                } else if (!strcmp(args[0], "delete")) {
+                    send_protocol(window, wm_atoms[WM_DELETE_WINDOW]);
+                } else if (!strcmp(args[0], "fullscreen")){
+                    fullscreen_window(window);
+                } else if (!strcmp(args[0], "tile")) {
+                    tile_window(window, grid_w, grid_h, w, h, x, y);
+                } else if (!strcmp(args[0], "iconify")) {
+                    iconify_window(window, true);
+                }
             }
+            free(windows);
         }
     }
     free(args);
-    XSync(display, False);
-    fflush(response);
-    fclose(response);
+    /* replies that depend on server state already waited for it, so the
+     * requests only need to be on their way */
+    stats.commands++;
+    stats.syncs_saved++;
+    windows_dirty = true;
+    xcb_flush(connection);
+}
+
+void add_peer(int fd) {
+    Peer *peer;
+
+    struct epoll_event event;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    peer = calloc(1, sizeof(Peer));
+    peer->fd = fd;
+    peer->events = EPOLLIN;
+    peer->next = peers;
+    peers = peer;
+
+    event.events = peer->events;
+    event.data.ptr = peer;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+size_t get_backlog(Peer *peer) {
+    return peer->out_len - peer->out_sent + peer->ring_len;
+}
+
+/* a client may shut down writing and still wait for its answers */
+bool has_waiters(Peer *peer) {
+    Waiter *waiter;
+
+    for (waiter = waiters; waiter && waiter->peer != peer; waiter = waiter->next);
+    return waiter != NULL;
+}
+
+/* watch for whatever the peer is waiting on now */
+void update_peer(Peer *peer) {
+    struct epoll_event event;
+
+    event.events = ((peer->closing || get_backlog(peer) >= PEER_BUFFER_MAX ? 0 : EPOLLIN) |
+                    (get_backlog(peer) ? EPOLLOUT : 0));
+    if (event.events != peer->events) {
+        peer->events = event.events;
+        event.data.ptr = peer;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, peer->fd, &event);
+    }
+}
+
+void free_waiter(Waiter *waiter) {
+    Waiter **link;
+
+    for (link = &waiters; *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            break;
+        }
+    }
+    cancel_timer(&waiter->timer);
+    free_selector(&waiter->selector);
+    free(waiter);
+}
+
+void remove_peer(Peer *peer) {
+    Peer **link;
+    Waiter *waiter;
+    Waiter *next;
+
+    for (waiter = waiters; waiter; waiter = next) {
+        next = waiter->next;
+        if (waiter->peer == peer) {
+            free_waiter(waiter);
+        }
+    }
+
+    for (link = &peers; *link; link = &(*link)->next) {
+        if (*link == peer) {
+            *link = peer->next;
+            break;
+        }
+    }
+    close(peer->fd);
+    free(peer->in);
+    free(peer->out);
+    free(peer->ring);
+    free(peer);
+}
+
+
+void queue_output(Peer *peer, const char *data, size_t length) {
+    if (peer->out_sent == peer->out_len) {
+        peer->out_sent = peer->out_len = 0;
+    }
+    peer->out = realloc(peer->out, peer->out_len + length);
+    memcpy(peer->out + peer->out_len, data, length);
+    peer->out_len += length;
+}
+
+/* a message is a list of NUL terminated arguments ended by an empty one;
+ * returns the length of the first complete message in buffer, or 0 */
+size_t get_message_length(const char *buffer, size_t length) {
+    size_t start = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (buffer[i] == '\0') {
+            if (i == start) {
+                return i + 1;
+            }
+            start = i + 1;
+        }
+    }
+    return 0;
+}
+
+/* run the command in message and queue its response: the status character
+ * followed by the output, or in a session a "<seq> <status> <length>\n"
+ * header followed by the output */
+void queue_response(Peer *peer, const char *seq, char status, const char *output, size_t length) {
+    char header[64];
+    int header_length;
+
+    if (seq) {
+        header_length = snprintf(header, sizeof(header), "%.32s %c %zu\n", seq, status, length);
+        queue_output(peer, header, header_length);
+    } else {
+        queue_output(peer, &status, 1);
+    }
+    queue_output(peer, output, length);
+}
+
+void run_command(Peer *peer, char *message, int length, const char *seq) {
+    FILE *response;
+    char *output = NULL;
+    size_t output_size = 0;
+
+    unsigned int command = get_command_index(length ? message : "");
+    Measure measure;
+    long long start;
+
+    if ((response = open_memstream(&output, &output_size))) {
+        start = trace_start();
+        start_measure(&measure);
+        handle_command(message, length, response);
+        end_measure(&measure, &command_stats[command]);
+        trace_end("command", command_names[command], start);
+        fclose(response);
+        if (output_size) {
+            queue_response(peer, seq, *output, output + 1, output_size - 1);
+        } else {
+            queue_response(peer, seq, '1', NULL, 0);
+        }
+    }
+    free(output);
+}
+
+/* write the responses, then any events from the ring */
+void write_peer(Peer *peer) {
+    ssize_t sent;
+    size_t length;
+
+    while (get_backlog(peer)) {
+        if (peer->out_sent < peer->out_len) {
+            sent = send(peer->fd, peer->out + peer->out_sent, peer->out_len - peer->out_sent,
+                        MSG_NOSIGNAL);
+        } else {
+            length = SUBSCRIBER_BUFFER - peer->ring_start;
+            sent = send(peer->fd, peer->ring + peer->ring_start,
+                        peer->ring_len < length ? peer->ring_len : length, MSG_NOSIGNAL);
+        }
+        if (sent > 0 && peer->out_sent < peer->out_len) {
+            peer->out_sent += sent;
+        } else if (sent > 0) {
+            peer->ring_start = (peer->ring_start + sent) % SUBSCRIBER_BUFFER;
+            peer->ring_len -= sent;
+        } else if (sent == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                peer->out_sent = peer->out_len;
+                peer->ring_len = 0;
+                peer->closing = true;
+                peer->hung_up = true;
+            }
+            break;
+        }
+    }
+}
+
+/* Write out what is queued for a peer before wmd exits or restarts, such
+ * as the response to the quit or restart command itself, waiting for a
+ * slow reader but not for one that stopped reading. */
+void flush_peer(Peer *peer) {
+    struct timeval timeout = { 1, 0 };
+
+    fcntl(peer->fd, F_SETFL, fcntl(peer->fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(peer->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    write_peer(peer);
+}
+
+/* subscribe [<type>...]: turn the connection into a stream of event lines
+ * of the given types, or of every type */
+void subscribe_peer(Peer *peer, char *message, size_t length, const char *seq) {
+    unsigned int mask = 0;
+    char status = '0';
+    int type;
+
+    for (size_t i = strlen(message) + 1; i < length; i += strlen(message + i) + 1) {
+        for (type = 0; type < EVENT_COUNT && strcmp(message + i, event_names[type]); type++);
+        if (type == EVENT_COUNT) {
+            status = '1';
+        }
+        mask |= 1 << type;
+    }
+    queue_response(peer, seq, status, NULL, 0);
+    if (status == '0') {
+        peer->subscribed = true;
+        peer->event_mask = mask ? mask : (1 << EVENT_COUNT) - 1;
+    } else if (!seq) {
+        peer->closing = true;
+    }
+}
+
+/* answer with the line of the matching window, or fail without one */
+void answer_waiter(Waiter *waiter, Client *client) {
+    FILE *stream;
+    char *line = NULL;
+    size_t length = 0;
+
+    if (client && (stream = open_memstream(&line, &length))) {
+        print_window(stream, NULL, client->window,
+                     client->window == get_active_window() ? FLAG_ACTIVE : NULL);
+        fclose(stream);
+    }
+    queue_response(waiter->peer, waiter->session ? waiter->seq : NULL,
+                   client ? '0' : '1', line, length);
+    if (!waiter->session) {
+        waiter->peer->closing = true;
+    }
+    free(line);
+    free_waiter(waiter);
+}
+
+void wait_timeout(Timer *timer) {
+    answer_waiter((Waiter *) timer, NULL);
+}
+
+/* check the windows that changed since each waiter last looked */
+void check_waiters() {
+    Waiter *waiter;
+    Waiter *next;
+    Client *client;
+
+    for (waiter = waiters; waiter; waiter = next) {
+        next = waiter->next;
+        for (client = top_client; client; client = client->below) {
+            if (client->generation > waiter->since &&
+                match_selector(&waiter->selector, client, XCB_WINDOW_NONE)) {
+                break;
+            }
+        }
+        if (client) {
+            answer_waiter(waiter, client);
+        } else {
+            waiter->since = generation;
+        }
+    }
+}
+
+/* wait [--timeout <ms>] <selector>...: answer with the first window
+ * matching every selector, as soon as there is one */
+void wait_peer(Peer *peer, char *message, size_t length, const char *seq) {
+    Waiter *waiter = calloc(1, sizeof(Waiter));
+    Client *client;
+    char *arg;
+    int timeout = -1;
+    bool valid = true;
+
+    waiter->timer.callback = wait_timeout;
+    waiter->peer = peer;
+    waiter->session = seq != NULL;
+    snprintf(waiter->seq, sizeof(waiter->seq), "%s", seq ? seq : "");
+    waiter->next = waiters;
+    waiters = waiter;
+
+    for (size_t i = strlen(message) + 1; i < length; i += strlen(message + i) + 1) {
+        arg = message + i;
+        if (!strcmp(arg, "--timeout") && i + strlen(arg) + 1 < length) {
+            i += strlen(arg) + 1;
+            timeout = atoi(message + i);
+        } else {
+            valid &= parse_selector(&waiter->selector, arg);
+        }
+    }
+    /* the pointer isn't followed between events */
+    valid &= !strchr(waiter->selector.flags, *FLAG_POINTER);
+    if (!valid) {
+        answer_waiter(waiter, NULL);
+        return;
+    }
+
+    update_generation();
+    for (client = top_client;
+         client && !match_selector(&waiter->selector, client, XCB_WINDOW_NONE);
+         client = client->below);
+    if (client || !timeout) {
+        answer_waiter(waiter, client);
+        return;
+    }
+    waiter->since = generation;
+    if (timeout > 0) {
+        add_timer(&waiter->timer, timeout);
+    }
+}
+
+/* A connection carries a single command and is closed once answered,
+ * unless its first message is "session". That is answered with a frame
+ * with sequence number 0, and every later message starts with a sequence
+ * number of the client's choosing that is echoed in its response frame, so
+ * commands can be pipelined. */
+void handle_messages(Peer *peer) {
+    size_t offset = 0;
+    size_t length;
+    char *message;
+    char *seq;
+    size_t seq_length;
+
+    while (!peer->closing &&
+           (length = get_message_length(peer->in + offset, peer->in_len - offset))) {
+        message = peer->in + offset;
+        offset += length;
+        seq = NULL;
+        if (peer->subscribed) {
+            /* nothing more is expected from a subscriber */
+            continue;
+        } else if (peer->session) {
+            seq = message;
+            seq_length = strlen(message) + 1;
+            /* a frame needs a command after its sequence number */
+            if (seq_length >= length || !message[seq_length]) {
+                queue_response(peer, seq, '1', NULL, 0);
+                continue;
+            }
+            message += seq_length;
+            length -= seq_length;
+        } else if (!strcmp(message, "session") && length == sizeof("session") + 1) {
+            peer->session = true;
+            queue_output(peer, "0 0 0\n", 6);
+            continue;
+        }
+        if (!strcmp(message, "subscribe")) {
+            subscribe_peer(peer, message, length - 1, seq);
+        } else if (!strcmp(message, "wait")) {
+            wait_peer(peer, message, length - 1, seq);
+        } else {
+            run_command(peer, message, length - 1, seq);
+            peer->closing |= !seq;
+        }
+    }
+    memmove(peer->in, peer->in + offset, peer->in_len - offset);
+    peer->in_len -= offset;
+}
+
+void read_peer(Peer *peer) {
+    ssize_t received;
+    bool eof = false;
+
+    /* stop reading while the client is not reading its responses */
+    while (!eof && !peer->closing && get_backlog(peer) < PEER_BUFFER_MAX) {
+        if (peer->in_len + 1 >= peer->in_size) {
+            if (peer->in_size >= PEER_BUFFER_MAX) {
+                peer->in_len = 0;
+                peer->closing = true;
+                return;
+            }
+            peer->in_size = peer->in_size ? peer->in_size * 2 : 1024;
+            peer->in = realloc(peer->in, peer->in_size);
+        }
+        received = recv(peer->fd, peer->in + peer->in_len, peer->in_size - peer->in_len - 1, 0);
+        if (received > 0) {
+            peer->in_len += received;
+            handle_messages(peer);
+        } else if (received == -1 && errno == EINTR) {
+            continue;
+        } else if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            eof = true;
+        }
+    }
+
+    if (peer->closing) {
+        peer->in_len = 0;
+    } else if (eof) {
+        /* a single command whose client shut down writing without ending it */
+        if (!peer->session && !peer->subscribed && peer->in_len) {
+            if (peer->in[peer->in_len - 1] != '\0') {
+                peer->in[peer->in_len++] = '\0';
+            }
+            run_command(peer, peer->in, peer->in_len, NULL);
+        }
+        peer->in_len = 0;
+        peer->closing = true;
+    }
+}
+
+void accept_peers() {
+    int fd;
+
+    while ((fd = accept(sock_fd, NULL, NULL)) != -1) {
+        add_peer(fd);
+        /* the command is usually there already */
+        read_peer(peers);
+    }
 }
 
-void map_window(XMapRequestEvent *request) {
-    Window window = request->window;
+void map_window(xcb_map_request_event_t *request) {
+    xcb_window_t window = request->window;
+    xcb_get_property_cookie_t hints_cookie;
+    xcb_get_property_reply_t *hints;
+    uint32_t *values;
+
+    hints_cookie = request_property(window, XCB_ATOM_WM_HINTS, XCB_ATOM_WM_HINTS, 9);
+    fill_client(add_client(window, false));
     if (is_manageable_window(window)) {
         // TODO ResizeRedirectMask
-        XSelectInput(display, window, PropertyChangeMask|FocusChangeMask|StructureNotifyMask);
+        select_input(window, XCB_EVENT_MASK_PROPERTY_CHANGE|XCB_EVENT_MASK_FOCUS_CHANGE|XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+        get_client(window)->map_order = ++map_count;
         if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
             fullscreen_window(window);
-        } else {
+        } else if (auto_layout == LAYOUT_NONE || !is_layout_kind(get_client(window))) {
+            /* dialogs and the like are centred whatever the layout */
             // TODO if specified size & position
             tile_window(window, 1, 1, 1, 1, 0, 0);
         }
-        XWMHints *hints = NULL;
-        hints = XGetWMHints(display, window);
-        if (hints && hints->initial_state == IconicState) {
+        /* WM_HINTS is flags, input, initial_state, ... */
+        hints = get_property_reply(hints_cookie, 32);
+        values = hints ? xcb_get_property_value(hints) : NULL;
+        if (hints && hints->value_len >= 3 &&
+            values[0] & StateHint && values[2] == IconicState) {
             set_wm_state(window, IconicState);
         } else {
             set_wm_state(window, NormalState);
-            XMapWindow(display, window);
+            /* placed in the layout before it shows */
+            get_client(window)->map_state = XCB_MAP_STATE_VIEWABLE;
+            arrange_windows();
+            show_window(window);
             activate_window(window);
         }
-        if (hints) {
-            XFree(hints);
-        }
+        free(hints);
     } else {
-        XMapWindow(display, window);
-    }
-}
-
-void configure_window(XConfigureRequestEvent *request) {
-    Window window = request->window;
-    XWindowChanges changes;
-    unsigned value_mask = request->value_mask;
-    XSizeHints hints;
-    long supplied;
-    Atom type;
-
-    hints.flags = 0;
-    XGetWMNormalHints(display, window, &hints, &supplied);
-    type = get_atom_property(window, net_atoms[_NET_WM_WINDOW_TYPE]);
-    if (!is_managed_window(window) ||
-        (hints.flags & PPosition && hints.flags & PSize)) {
-        changes.x = request->x;
-        changes.y = request->y;
-        changes.width = request->width;
-        changes.height = request->height;
-    } else if (type == net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] ||
-               type == net_atoms[_NET_WM_WINDOW_TYPE_SPLASH]) {
-        XWindowAttributes attributes;
-        XGetWindowAttributes(display, window, &attributes);
-        value_mask &= ~(CWX|CWY);
-        if (value_mask & CWWidth) {
-            changes.width = request->width;
-            changes.x = attributes.x + (attributes.width - changes.width) / 2;
-            value_mask |= CWX;
-        }
-        if (value_mask & CWHeight) {
-            changes.height = request->height;
-            changes.y = attributes.y + (attributes.height - changes.height) / 2;
-            value_mask |= CWY;
+        xcb_discard_reply(connection, hints_cookie.sequence);
+        xcb_map_window(connection, window);
+    }
+}
+
+void configure_window(xcb_configure_request_event_t *request) {
+    xcb_window_t window = request->window;
+    uint16_t value_mask = request->value_mask;
+    uint32_t values[7];
+    int nvalues = 0;
+    SizeHints hints;
+    bool managed;
+    Client *client = NULL;
+    int x = request->x;
+    int y = request->y;
+    xcb_window_t sibling = request->sibling;
+    uint8_t stack_mode = request->stack_mode;
+
+    /* a managed window has a client with its geometry, type and, after the
+     * first request, its hints cached */
+    if ((managed = is_managed_window(window))) {
+        client = get_client(window);
+        get_client_hints(client, &hints);
+    }
+    if (!managed || (hints.flags & PPosition && hints.flags & PSize)) {
+    } else if (client->type == net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] ||
+               client->type == net_atoms[_NET_WM_WINDOW_TYPE_SPLASH]) {
+        value_mask &= ~(XCB_CONFIG_WINDOW_X|XCB_CONFIG_WINDOW_Y);
+        if (value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+            x = client->x + (client->width - request->width) / 2;
+            value_mask |= XCB_CONFIG_WINDOW_X;
+        }
+        if (value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+            y = client->y + (client->height - request->height) / 2;
+            value_mask |= XCB_CONFIG_WINDOW_Y;
         }
     } else {
-        value_mask &= ~(CWX|CWY|CWWidth|CWHeight);
-    }
-    changes.border_width = request->border_width;
-    if (value_mask & CWStackMode &&
-        request->detail == Above &&
-        request->above == None) {
-        request->detail = Below;
-        Window *windows = NULL;
-        unsigned int nwindows;
-        nwindows = get_windows(&is_not_above_window, &windows);
-        for (unsigned int i = 0; i < nwindows; i++) {
-            if (windows[i] != window) {
-                request->detail = Above;
-                changes.sibling = windows[i];
-                value_mask |= CWSibling;
-                break;
-            }
+        value_mask &= ~(XCB_CONFIG_WINDOW_X|XCB_CONFIG_WINDOW_Y|XCB_CONFIG_WINDOW_WIDTH|XCB_CONFIG_WINDOW_HEIGHT);
+    }
+    /* raising to the top means the top of the window's layer */
+    if (value_mask & XCB_CONFIG_WINDOW_STACK_MODE &&
+        stack_mode == XCB_STACK_MODE_ABOVE &&
+        sibling == XCB_WINDOW_NONE) {
+        Client *ceiling = get_layer_ceiling((client = get_client(window)) ? client->layer : LAYER_NORMAL);
+        if (ceiling) {
+            stack_mode = XCB_STACK_MODE_BELOW;
+            sibling = ceiling->window;
+            value_mask |= XCB_CONFIG_WINDOW_SIBLING;
+        }
+    }
+
+    /* values are packed in the order of their mask bits */
+    if (value_mask & XCB_CONFIG_WINDOW_X) {
+        values[nvalues++] = x;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_Y) {
+        values[nvalues++] = y;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+        values[nvalues++] = request->width;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+        values[nvalues++] = request->height;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
+        values[nvalues++] = request->border_width;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_SIBLING) {
+        values[nvalues++] = sibling;
+    }
+    if (value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+        values[nvalues++] = stack_mode;
+    }
+    configure(window, value_mask, values);
+}
+
+void restack_client(xcb_window_t window, xcb_window_t sibling) {
+    Client *client;
+
+    if ((client = get_client(window))) {
+        stack_client(client, sibling == XCB_WINDOW_NONE ? NULL : get_client(sibling));
+    }
+}
+
+void update_client_property(xcb_window_t window, xcb_atom_t atom) {
+    Client *client;
+
+    if (!(client = get_client(window))) {
+        return;
+    }
+    if (atom == wm_atoms[WM_STATE]) {
+        if (client->wm_state_writes) {
+            client->wm_state_writes--;
+        } else {
+            update_wm_state(client);
         }
-        if (windows) {
-            XFree(windows);
+    } else if (atom == net_atoms[_NET_WM_STATE]) {
+        if (client->net_wm_state_writes) {
+            client->net_wm_state_writes--;
+        } else {
+            update_net_wm_state(client);
         }
-    } else {
-        changes.sibling = request->above;
+    } else if (atom == net_atoms[_NET_WM_WINDOW_TYPE]) {
+        update_window_type(client);
+    } else if (atom == XCB_ATOM_WM_NORMAL_HINTS) {
+        client->hints_cached = false;
+    } else if (atom == _MOTIF_WM_HINTS) {
+        client->motif_cached = false;
+    } else if (atom == wm_atoms[WM_PROTOCOLS]) {
+        free(client->protocols);
+        client->protocols = NULL;
+        client->nprotocols = 0;
+        client->protocols_cached = false;
+    } else if (atom == XCB_ATOM_WM_NAME ||
+               atom == net_atoms[_NET_WM_NAME] ||
+               atom == XCB_ATOM_WM_CLASS ||
+               atom == net_atoms[_NET_WM_PID]) {
+        client->stale = true;
+        clients_stale = true;
     }
-    changes.stack_mode = request->detail;
-    XConfigureWindow(display, window, value_mask, &changes);
 }
 
-void handle_event(XEvent *event) {
-    Window window;
-    switch(event->type) {
-        case MapRequest:
-            map_window(&event->xmaprequest);
+void handle_event(xcb_generic_event_t *event) {
+    xcb_window_t window;
+    Client *client;
+    switch(event->response_type & ~0x80) {
+        case XCB_CREATE_NOTIFY: {
+            xcb_create_notify_event_t *create = (xcb_create_notify_event_t *) event;
+            if (create->parent == root) {
+                add_client(create->window, create->override_redirect);
+            }
+            break;
+        }
+        case XCB_DESTROY_NOTIFY: {
+            xcb_destroy_notify_event_t *destroy = (xcb_destroy_notify_event_t *) event;
+            if (destroy->event == root) {
+                remove_client(destroy->window);
+            }
+            break;
+        }
+        case XCB_REPARENT_NOTIFY: {
+            xcb_reparent_notify_event_t *reparent = (xcb_reparent_notify_event_t *) event;
+            if (reparent->event != root) {
+            } else if (reparent->parent == root) {
+                add_client(reparent->window, reparent->override_redirect);
+            } else {
+                remove_client(reparent->window);
+            }
+            break;
+        }
+        case XCB_MAP_NOTIFY: {
+            xcb_map_notify_event_t *map = (xcb_map_notify_event_t *) event;
+            if (map->event == root &&
+                (client = get_client(map->window))) {
+                client->map_state = XCB_MAP_STATE_VIEWABLE;
+            }
+            break;
+        }
+        case XCB_UNMAP_NOTIFY: {
+            xcb_unmap_notify_event_t *unmap = (xcb_unmap_notify_event_t *) event;
+            if (unmap->event == root &&
+                (client = get_client(unmap->window))) {
+                client->map_state = XCB_MAP_STATE_UNMAPPED;
+            }
+            break;
+        }
+        case XCB_CIRCULATE_NOTIFY: {
+            xcb_circulate_notify_event_t *circulate = (xcb_circulate_notify_event_t *) event;
+            if (circulate->event == root &&
+                (client = get_client(circulate->window))) {
+                stack_client(client, circulate->place == XCB_PLACE_ON_TOP ? top_client : NULL);
+            }
+            break;
+        }
+        case XCB_MAP_REQUEST:
+            map_window((xcb_map_request_event_t *) event);
             break;
-        case ConfigureRequest:
-            configure_window(&event->xconfigurerequest);
+        case XCB_CONFIGURE_REQUEST:
+            configure_window((xcb_configure_request_event_t *) event);
             break;
-        case FocusIn:
-            if ((event->xfocus.mode == NotifyNormal ||
-                 event->xfocus.mode == NotifyWhileGrabbed) &&
-                event->xfocus.window == root) {
-                activate_window(None);
+        case XCB_FOCUS_IN: {
+            xcb_focus_in_event_t *focus = (xcb_focus_in_event_t *) event;
+            if ((focus->mode == XCB_NOTIFY_MODE_NORMAL ||
+                 focus->mode == XCB_NOTIFY_MODE_WHILE_GRABBED) &&
+                focus->event == root) {
+                activate_window(XCB_WINDOW_NONE);
             }
             break;
-        case ConfigureNotify:
-            if (event->xconfigure.window == root &&
-                (screen_width != event->xconfigure.width ||
-                 screen_height != event->xconfigure.height)) {
-                screen_width = event->xconfigure.width;
-                screen_height = event->xconfigure.height;
-                print_window(fifo, prefix, root, NULL);
+        }
+        case XCB_CONFIGURE_NOTIFY: {
+            xcb_configure_notify_event_t *configure = (xcb_configure_notify_event_t *) event;
+            if (configure->window == root &&
+                (screen_width != configure->width ||
+                 screen_height != configure->height)) {
+                screen_width = configure->width;
+                screen_height = configure->height;
+                reset_layout();
+                publish_event(EVENT_ROOT, root, NULL);
+            } else if (configure->event == root &&
+                       configure->window != root) {
+                if ((client = get_client(configure->window))) {
+                    client->border_width = configure->border_width;
+                    client->x = configure->x;
+                    client->y = configure->y;
+                    client->width = configure->width;
+                    client->height = configure->height;
+                }
+                restack_client(configure->window, configure->above_sibling);
             }
             break;
-        case PropertyNotify:
-            window = event->xproperty.window;
-            if ((event->xproperty.atom == XA_WM_NAME ||
-                 event->xproperty.atom == net_atoms[_NET_WM_NAME]) &&
-                window == get_active_window()) {
-                print_window(fifo, prefix, event->xproperty.window, FLAG_ACTIVE);
+        }
+        case XCB_PROPERTY_NOTIFY: {
+            xcb_property_notify_event_t *property = (xcb_property_notify_event_t *) event;
+            window = property->window;
+            if ((property->atom == XCB_ATOM_WM_NAME ||
+                 property->atom == net_atoms[_NET_WM_NAME]) &&
+                window == get_active_window() &&
+                (client = get_client(window))) {
+                client->title_changed = true;
+                titles_changed = true;
             }
-            /* else if (event->xproperty.atom == net_atoms[_NET_WM_STATE] && */
-            /*            is_managed_window(window)) { */
-            /* } */
+            if (window == root && property->atom == XCB_ATOM_RESOURCE_MANAGER) {
+                reload_resources();
+            }
+            update_client_property(window, property->atom);
             break;
-        case ClientMessage:
-            window = event->xclient.window;
+        }
+        case XCB_CLIENT_MESSAGE: {
+            xcb_client_message_event_t *message = (xcb_client_message_event_t *) event;
+            uint32_t *data = message->data.data32;
+            window = message->window;
             if (is_managed_window(window)) {
             }
-            if (event->xclient.message_type == wm_atoms[WM_CHANGE_STATE]) {
-                if (event->xclient.data.l[0] == IconicState) {
-                    iconify_window(window, True);
-                } else if (event->xclient.data.l[0] == NormalState) {
-                    iconify_window(window, False);
+            if (message->type == wm_atoms[WM_CHANGE_STATE]) {
+                if (data[0] == IconicState) {
+                    iconify_window(window, true);
+                } else if (data[0] == NormalState) {
+                    iconify_window(window, false);
                 }
-            } else if (event->xclient.message_type == net_atoms[_NET_WM_STATE]) {
-                if (event->xclient.data.l[1] == net_atoms[_NET_WM_STATE_ABOVE] ||
-                    event->xclient.data.l[2] == net_atoms[_NET_WM_STATE_ABOVE]) {
-                    switch (event->xclient.data.l[0]) {
+            } else if (message->type == net_atoms[_NET_WM_STATE]) {
+                if (data[1] == net_atoms[_NET_WM_STATE_ABOVE] ||
+                    data[2] == net_atoms[_NET_WM_STATE_ABOVE]) {
+                    uint32_t above = XCB_STACK_MODE_ABOVE;
+                    switch (data[0]) {
                         case _NET_WM_STATE_REMOVE:
-                            set_net_wm_state(window, net_atoms[_NET_WM_STATE_ABOVE], False);
+                            set_net_wm_state(window, net_atoms[_NET_WM_STATE_ABOVE], false);
                             break;
                         case _NET_WM_STATE_ADD:
-                            set_net_wm_state(window, net_atoms[_NET_WM_STATE_ABOVE], True);
-                            XRaiseWindow(display, window);
+                            set_net_wm_state(window, net_atoms[_NET_WM_STATE_ABOVE], true);
+                            configure(window, XCB_CONFIG_WINDOW_STACK_MODE, &above);
                             break;
                         case _NET_WM_STATE_TOGGLE:
                             break;
                     }
                 }
-                if (event->xclient.data.l[1] == net_atoms[_NET_WM_STATE_FULLSCREEN] ||
-                    event->xclient.data.l[2] == net_atoms[_NET_WM_STATE_FULLSCREEN]) {
-                    switch (event->xclient.data.l[0]) {
+                if (data[1] == net_atoms[_NET_WM_STATE_FULLSCREEN] ||
+                    data[2] == net_atoms[_NET_WM_STATE_FULLSCREEN]) {
+                    switch (data[0]) {
                         case _NET_WM_STATE_REMOVE:
-                            tile_window(window, 1, 1, 1, 1, 0, 0);
+                            restore_window(window);
                             break;
                         case _NET_WM_STATE_ADD:
                             fullscreen_window(window);
                             break;
                         case _NET_WM_STATE_TOGGLE:
                             if (is_net_wm_state_set(window, net_atoms[_NET_WM_STATE_FULLSCREEN])) {
-                                tile_window(window, 1, 1, 1, 1, 0, 0);
+                                restore_window(window);
                             } else {
                                 fullscreen_window(window);
                             }
                             break;
                     }
                 }
-            } else if (event->xclient.message_type == net_atoms[_NET_ACTIVE_WINDOW]) {
-                activate_window(event->xclient.window);
+            } else if (message->type == net_atoms[_NET_ACTIVE_WINDOW]) {
+                activate_window(message->window);
             }
             break;
+        }
     }
-    XSync(display, False);
+    stats.events++;
+    stats.syncs_saved++;
+    windows_dirty = true;
 }
 
 void handle_signal(int signal) {
     if (signal == SIGINT || signal == SIGTERM) {
-        quit = True;
+        quit = true;
     }
 }
 
@@ -989,13 +3729,22 @@ int main(int argc, char *argv[]) {
     int opt;
     char *fifo_path = NULL;
     int fifo_fd;
-    int x_fd;
+    char *dpy;
     char *sock_dir;
-    int sock_fd;
     struct sockaddr_un sock_addr;
-    fd_set fds;
-
-    while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+    char snapshot_path[sizeof(sock_addr.sun_path) + sizeof(WMC_SNAPSHOT_SUFFIX)];
+    char handoff_path[sizeof(sock_addr.sun_path) + sizeof(HANDOFF_SUFFIX)];
+    struct epoll_event events[32];
+    struct epoll_event watch;
+    int nevents;
+    int screen_number;
+    long long start_time = get_time();
+    xcb_intern_atom_cookie_t wm_atom_cookies[wm_atoms_count];
+    xcb_intern_atom_cookie_t net_atom_cookies[net_atoms_count];
+    xcb_intern_atom_cookie_t motif_cookie;
+    xcb_intern_atom_cookie_t utf8_cookie;
+
+    while ((opt = getopt(argc, argv, "p:s:t:")) != -1) {
         switch (opt) {
             case 'p':
                 prefix = optarg;
@@ -1003,67 +3752,78 @@ int main(int argc, char *argv[]) {
             case 's':
                 fifo_path = optarg;
                 break;
+            case 't':
+                title_interval = atoi(optarg);
+                break;
             case '?':
                 fprintf(stderr, "\n");
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (!(display = XOpenDisplay(NULL))) {
+    connection = xcb_connect(NULL, &screen_number);
+    if (xcb_connection_has_error(connection) || !(dpy = getenv("DISPLAY"))) {
         fprintf(stderr, "\n");
         exit(EXIT_FAILURE);
     }
 
-    XSetErrorHandler(error_handler);
-
-    screen = DefaultScreen(display);
-    screen_width = XDisplayWidth(display, screen);
-    screen_height = XDisplayHeight(display, screen);
-    root = RootWindow(display, screen);
+    xcb_screen_iterator_t screens = xcb_setup_roots_iterator(xcb_get_setup(connection));
+    for (; screen_number > 0 && screens.rem > 1; screen_number--) {
+        xcb_screen_next(&screens);
+    }
+    screen = screens.data;
+    screen_width = screen->width_in_pixels;
+    screen_height = screen->height_in_pixels;
+    root = screen->root;
     read_resources();
-    XSelectInput(display, root, StructureNotifyMask|SubstructureNotifyMask|SubstructureRedirectMask|FocusChangeMask);
-
-    wm_atoms[WM_PROTOCOLS] = XInternAtom(display, "WM_PROTOCOLS", False);
-    wm_atoms[WM_STATE] = XInternAtom(display, "WM_STATE", False);
-    wm_atoms[WM_CHANGE_STATE] = XInternAtom(display, "WM_CHANGE_STATE", False);
-    wm_atoms[WM_TAKE_FOCUS] = XInternAtom(display, "WM_TAKE_FOCUS", False);
-    wm_atoms[WM_DELETE_WINDOW] = XInternAtom(display, "WM_DELETE_WINDOW", False);
-
-    net_atoms[_NET_SUPPORTED] = XInternAtom(display, "_NET_SUPPORTED", False);
-    net_atoms[_NET_SUPPORTING_WM_CHECK] = XInternAtom(display, "_NET_SUPPORTING_WM_CHECK", False);
-    net_atoms[_NET_ACTIVE_WINDOW] = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
-    net_atoms[_NET_WM_NAME] = XInternAtom(display, "_NET_WM_NAME", False);
-    net_atoms[_NET_WM_PID] = XInternAtom(display, "_NET_WM_PID", False);
-    net_atoms[_NET_WM_STATE] = XInternAtom(display, "_NET_WM_STATE", False);
-    net_atoms[_NET_WM_STATE_ABOVE] = XInternAtom(display, "_NET_WM_STATE_ABOVE", False);
-    net_atoms[_NET_WM_STATE_FULLSCREEN] = XInternAtom(display, "_NET_WM_STATE_FULLSCREEN", False);
-    net_atoms[_NET_WM_WINDOW_TYPE] = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
-    net_atoms[_NET_WM_WINDOW_TYPE_DIALOG] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DIALOG", False);
-    net_atoms[_NET_WM_WINDOW_TYPE_DOCK] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DOCK", False);
-    net_atoms[_NET_WM_WINDOW_TYPE_SPLASH] = XInternAtom(display, "_NET_WM_WINDOW_TYPE_SPLASH", False);
-    _MOTIF_WM_HINTS = XInternAtom(display, "_MOTIF_WM_HINTS", False);
-
-    XChangeProperty(display, root, net_atoms[_NET_SUPPORTED], XA_ATOM, 32,
-                    PropModeReplace, (unsigned char *) net_atoms, net_atoms_count);
-
-    Window *windows = NULL;
+    select_input(root, XCB_EVENT_MASK_STRUCTURE_NOTIFY|XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY|XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT|XCB_EVENT_MASK_FOCUS_CHANGE|XCB_EVENT_MASK_PROPERTY_CHANGE);
+
+    /* every atom is requested before any reply is waited on */
+    for (int i = 0; i < wm_atoms_count; i++) {
+        wm_atom_cookies[i] = request_atom(wm_atom_names[i]);
+    }
+    for (int i = 0; i < net_atoms_count; i++) {
+        net_atom_cookies[i] = request_atom(net_atom_names[i]);
+    }
+    motif_cookie = request_atom("_MOTIF_WM_HINTS");
+    utf8_cookie = request_atom("UTF8_STRING");
+    for (int i = 0; i < wm_atoms_count; i++) {
+        wm_atoms[i] = get_intern_atom_reply(wm_atom_cookies[i]);
+    }
+    for (int i = 0; i < net_atoms_count; i++) {
+        net_atoms[i] = get_intern_atom_reply(net_atom_cookies[i]);
+    }
+    _MOTIF_WM_HINTS = get_intern_atom_reply(motif_cookie);
+    UTF8_STRING = get_intern_atom_reply(utf8_cookie);
+
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, root, net_atoms[_NET_SUPPORTED],
+                        XCB_ATOM_ATOM, 32, net_atoms_count, net_atoms);
+
+    active_window = read_active_window();
+
+    adopt_windows();
+
+    xcb_window_t *windows = NULL;
     unsigned int nwindows;
     nwindows = get_managed_windows(&windows);
     for (unsigned int i = 0; i < nwindows; i++) {
-        XSelectInput(display, windows[i], PropertyChangeMask|FocusChangeMask|StructureNotifyMask);
+        select_input(windows[i], XCB_EVENT_MASK_PROPERTY_CHANGE|XCB_EVENT_MASK_FOCUS_CHANGE|XCB_EVENT_MASK_STRUCTURE_NOTIFY);
+        /* topmost first, so the topmost counts as the newest */
+        get_client(windows[i])->map_order = nwindows - i;
     }
+    map_count = nwindows;
     if (windows) {
-        XFree(windows);
+        free(windows);
     }
 
-    x_fd = XConnectionNumber(display);
+    x_fd = xcb_get_file_descriptor(connection);
 
     if (!(sock_dir = getenv("XDG_RUNTIME_DIR"))) {
         sock_dir = "/tmp";
     }
 
     sock_addr.sun_family = AF_UNIX;
-    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s/wmd%s", sock_dir, XDisplayString(display) + 1);
+    snprintf(sock_addr.sun_path, sizeof(sock_addr.sun_path), "%s/wmd%s", sock_dir, dpy + 1);
     sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock_fd == -1) {
         fprintf(stderr, "\n");
@@ -1072,6 +3832,11 @@ int main(int argc, char *argv[]) {
 
     unlink(sock_addr.sun_path);
 
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s%s", sock_addr.sun_path, WMC_SNAPSHOT_SUFFIX);
+    open_snapshot(snapshot_path);
+    snprintf(handoff_path, sizeof(handoff_path), "%s%s", sock_addr.sun_path, HANDOFF_SUFFIX);
+    read_handoff(handoff_path);
+
     if (bind(sock_fd, (struct sockaddr *) &sock_addr, sizeof(sock_addr)) == -1) {
         fprintf(stderr, "\n");
         exit(EXIT_FAILURE);
@@ -1081,6 +3846,21 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "\n");
         exit(EXIT_FAILURE);
     }
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (epoll_fd == -1 || timer_fd == -1) {
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+    }
+    watch.events = EPOLLIN;
+    watch.data.ptr = &x_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, x_fd, &watch);
+    watch.data.ptr = &sock_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &watch);
+    watch.data.ptr = &timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &watch);
 
     if (fifo_path != NULL) {
         fifo_fd = open(fifo_path, O_RDWR | O_NONBLOCK);
@@ -1092,69 +3872,128 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    XEvent event;
-    int cmd_fd;
-    int cmd_size = 1024;
-    char *cmd_buf = malloc(cmd_size);
-    int cmd_len;
+    xcb_generic_event_t *event;
+    Measure measure;
+    int type;
+    long long start;
+    Peer *peer;
+    Peer *next;
 
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    Window wm_window = XCreateSimpleWindow(display, root, 0, 0, 1, 1, 0, 0, 0);
+    xcb_window_t wm_window = xcb_generate_id(connection);
+    xcb_create_window(connection, XCB_COPY_FROM_PARENT, wm_window, root, 0, 0, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, 0, NULL);
     set_window_property(wm_window, net_atoms[_NET_SUPPORTING_WM_CHECK], wm_window);
     set_window_property(root, net_atoms[_NET_SUPPORTING_WM_CHECK], wm_window);
-    XChangeProperty(display, wm_window, net_atoms[_NET_WM_NAME],
-                    XInternAtom(display, "UTF8_STRING", False), 8,
-                    PropModeReplace, (unsigned char *) "wmd", 3);
+    xcb_change_property(connection, XCB_PROP_MODE_REPLACE, wm_window, net_atoms[_NET_WM_NAME],
+                        UTF8_STRING, 8, 3, "wmd");
 
-    print_window(fifo, prefix, root, NULL);
+    publish_event(EVENT_ROOT, root, NULL);
+    stats.ready_ms = get_time() - start_time;
 
     while(!restart && !quit) {
-        FD_ZERO(&fds);
-        FD_SET(sock_fd, &fds);
-        FD_SET(x_fd, &fds);
-        if(select(FD_SETSIZE, &fds, NULL, NULL, NULL) > 0) {
-            if (FD_ISSET(x_fd, &fds)) {
-                while(XPending(display) && !XNextEvent(display, &event)) {
-                    handle_event(&event);
-                }
+        /* Handle the whole batch of pending events, including those queued
+         * while waiting on replies, then do the once per batch work and
+         * flush. That work waits on replies too, and libxcb queues the
+         * events read meanwhile without the X fd staying readable, so go
+         * round again until none are queued before waiting in epoll. */
+        event = xcb_poll_for_event(connection);
+        do {
+            for (; event; event = xcb_poll_for_event(connection)) {
+                type = event->response_type & ~0x80;
+                start = trace_start();
+                start_measure(&measure);
+                handle_event(event);
+                end_measure(&measure, &event_stats[type]);
+                trace_end("event", event_type_names[type] ? event_type_names[type] : "event", start);
+                free(event);
             }
+            if (xcb_connection_has_error(connection)) {
+                break;
+            }
+            /* the once per batch work, traced as one span */
+            start = trace_start();
+            flush_titles();
+            if (windows_dirty) {
+                arrange_windows();
+                update_generation();
+                write_snapshot();
+                check_waiters();
+                windows_dirty = false;
+            }
+            xcb_flush(connection);
+            trace_end("wm", "batch", start);
+        } while ((event = xcb_poll_for_queued_event(connection)));
+        if (xcb_connection_has_error(connection)) {
+            break;
+        }
 
-            if (FD_ISSET(sock_fd, &fds)) {
-                cmd_fd = accept(sock_fd, NULL, 0);
-                if (cmd_fd > 0) {
-                    cmd_len = 0;
-
-                    while ((cmd_len += recv(cmd_fd, cmd_buf + cmd_len, cmd_size - cmd_len, 0)) == cmd_size) {
-                        cmd_size *= 2;
-                        cmd_buf = realloc(cmd_buf, cmd_size);
-                    }
+        /* write out responses and events before waiting again; peers are
+         * only freed here, after every event naming them */
+        for (peer = peers; peer; peer = next) {
+            next = peer->next;
+            write_peer(peer);
+            if (peer->closing && !get_backlog(peer) &&
+                (peer->hung_up || !has_waiters(peer))) {
+                remove_peer(peer);
+            } else {
+                update_peer(peer);
+            }
+        }
 
-                    if (cmd_len > 0) {
-                        FILE* res = fdopen(cmd_fd, "w");
-                        if (res != NULL) {
-                            handle_command(cmd_buf, cmd_len, res);
-                        } else {
-                            close(cmd_fd);
-                        }
-                    }
+        nevents = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events), -1);
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == &x_fd) {
+                /* read at the top of the loop */
+            } else if (events[i].data.ptr == &sock_fd) {
+                accept_peers();
+            } else if (events[i].data.ptr == &timer_fd) {
+                run_timers();
+            } else {
+                peer = events[i].data.ptr;
+                if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                    read_peer(peer);
+                }
+                if (events[i].events & (EPOLLHUP|EPOLLERR)) {
+                    peer->hung_up = true;
                 }
             }
         }
     }
-    XDestroyWindow(display, wm_window);
+    xcb_destroy_window(connection, wm_window);
 
     if (fifo != NULL) {
         fclose(fifo);
     }
 
-    free(cmd_buf);
+    while (peers) {
+        flush_peer(peers);
+        remove_peer(peers);
+    }
 
     close(sock_fd);
     unlink(sock_addr.sun_path);
+    /* readers keep their mapping across a restart */
+    if (snapshot) {
+        if (!restart) {
+            unlink(snapshot_path);
+        }
+        munmap(snapshot, snapshot->size);
+        close(snapshot_fd);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+
+    if (restart) {
+        write_handoff(handoff_path);
+    }
+    while (top_client) {
+        remove_client(top_client->window);
+    }
 
-    XCloseDisplay(display);
+    xcb_disconnect(connection);
 
     if (restart) {
         execvp(argv[0], argv);